@@ -4,6 +4,35 @@
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <set>
+#include <map>
+#include <typeindex>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <tuple>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <coroutine>
+#include <queue>
+#include <random>
+#include <unordered_set>
+#include <utility>
+#include <fstream>
+#include <bit>
+#include <numeric>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SPACEINVADER_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -11,6 +40,16 @@
 
 const int SCREEN_WIDTH = 800, SCREEN_HEIGHT = 600;
 
+// Gameplay messages (hits, shots, waves) go to std::cout unless turned off, headless batches run silent
+bool g_eventLog = true;
+
+std::ostream &EventLog()
+{
+    // a stream without a buffer drops everything written to it
+    static thread_local std::ostream discard(nullptr);
+    return g_eventLog ? std::cout : discard;
+}
+
 // Define entity ID type
 using EntityID = unsigned int;
 
@@ -21,530 +60,4696 @@ using ComponentID = size_t;
 template <typename T>
 using ComponentStorage = std::vector<T>;
 
-// Define component ID generator
+// Define component ID generator, every component type gets the next ID the first time it is asked for
+inline ComponentID NextComponentID()
+{
+    static std::atomic<ComponentID> nextId{0};
+    return nextId++;
+}
+
 template <typename T>
 ComponentID GetComponentID()
 {
-    static ComponentID id = 0;
-    return id++;
+    static ComponentID id = NextComponentID();
+    return id;
 }
 
-// Define ECS class
-class ECS
+// Scoped timing zones recorded into per-thread ring buffers, exported in the Chrome trace_event format.
+// Build with -DSPACEINVADER_NO_PROFILE to compile every zone out.
+#ifndef SPACEINVADER_NO_PROFILE
+class Profiler
 {
-private:
-    EntityID GetNextEntityID()
+public:
+    // Zones kept per thread, older ones are overwritten
+    static const size_t ZONES_PER_THREAD = 1 << 16;
+
+    static Profiler &Get()
     {
-        static EntityID nextEntityId = 0;
-        return nextEntityId++;
+        static Profiler profiler;
+        return profiler;
     }
 
-public:
-    // Create entity with given ID
-    EntityID CreateEntity()
+    void Record(const char *name, uint64_t start, uint64_t end)
     {
-        EntityID id = GetNextEntityID();
-        m_entities.emplace_back(id);
-        return id;
+        ThreadBuffer &buffer = Local();
+        uint64_t count = buffer.count.load(std::memory_order_relaxed);
+        buffer.zones[count % ZONES_PER_THREAD] = Zone{name, start, end};
+        buffer.count.store(count + 1, std::memory_order_release);
     }
 
-    // Destroy entity with given ID
-    void DestroyEntity(EntityID id)
+    // Name shown for the calling thread in the trace viewer
+    void SetThreadName(const char *name)
     {
-        for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
+        Local().name = name;
+    }
+
+    // Write the recorded zones of every thread as a Chrome trace_event JSON file (chrome://tracing, Perfetto).
+    // Threads keep recording meanwhile; a zone overwritten during the export may come out garbled.
+    bool ExportChromeTrace(const std::string &path)
+    {
+        std::ofstream out(path);
+        if (!out)
         {
-            if (it->GetID() == id)
+            std::cout << "Cannot write trace: " << path << std::endl;
+            return false;
+        }
+        double microsecondsPerCount = 1e6 / SDL_GetPerformanceFrequency();
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t thread = 0; thread < m_buffers.size(); thread++)
+        {
+            ThreadBuffer &buffer = *m_buffers[thread];
+            out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+                << ",\"args\":{\"name\":\"" << (buffer.name ? buffer.name : "Thread") << "\"}}";
+            first = false;
+            uint64_t count = buffer.count.load(std::memory_order_acquire);
+            uint64_t begin = count > ZONES_PER_THREAD ? count - ZONES_PER_THREAD : 0;
+            for (uint64_t i = begin; i < count; i++)
             {
-                m_entities.erase(it);
-                break;
+                const Zone &zone = buffer.zones[i % ZONES_PER_THREAD];
+                out << ",\n{\"name\":\"" << zone.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread
+                    << ",\"ts\":" << (zone.start - m_origin) * microsecondsPerCount
+                    << ",\"dur\":" << (zone.end - zone.start) * microsecondsPerCount << "}";
             }
         }
+        out << "\n]}\n";
+        std::cout << "Trace written: " << path << std::endl;
+        return true;
     }
 
-    // Add component to entity with given ID
-    template <typename T>
-    void AddComponent(EntityID id, T component)
+private:
+    struct Zone
+    {
+        const char *name;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // Only written by its own thread
+    struct ThreadBuffer
+    {
+        const char *name = nullptr;
+        std::atomic<uint64_t> count{0};
+        std::vector<Zone> zones = std::vector<Zone>(ZONES_PER_THREAD);
+    };
+
+    Profiler() : m_origin(SDL_GetPerformanceCounter()) {}
+
+    ThreadBuffer &Local()
     {
-        GetComponentStorage<T>().emplace_back(component);
-        GetComponentMap<T>()[id] = GetComponentStorage<T>().size() - 1;
+        thread_local ThreadBuffer *buffer = nullptr;
+        if (buffer == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_buffers.push_back(std::make_unique<ThreadBuffer>());
+            buffer = m_buffers.back().get();
+        }
+        return *buffer;
     }
 
-    // Remove component from entity with given ID
-    template <typename T>
-    void RemoveComponent(EntityID id)
+    uint64_t m_origin;
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+};
+
+// Times the enclosing scope
+class ProfileZone
+{
+public:
+    ProfileZone(const char *name) : m_name(name), m_start(SDL_GetPerformanceCounter()) {}
+    ~ProfileZone() { Profiler::Get().Record(m_name, m_start, SDL_GetPerformanceCounter()); }
+
+private:
+    const char *m_name;
+    uint64_t m_start;
+};
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_THREAD(name) Profiler::Get().SetThreadName(name)
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_THREAD(name)
+#endif
+
+// Base of all secondary indices, lets the ECS drop destroyed entities from every index
+class ComponentIndexBase
+{
+public:
+    virtual ~ComponentIndexBase() = default;
+    virtual void Remove(EntityID id) = 0;
+};
+
+// Index over a field of component T, refreshed by the ECS whenever a T is added or replaced with AddComponent
+template <typename T>
+class TypedComponentIndex : public ComponentIndexBase
+{
+public:
+    virtual void Update(EntityID id, const T &component) = 0;
+};
+
+// Ordered index: entities sorted by a key read from a component field
+template <typename T, typename Key>
+class OrderedIndex : public TypedComponentIndex<T>
+{
+public:
+    using KeyFunc = std::function<Key(const T &)>;
+    using Entry = std::pair<Key, EntityID>;
+
+    explicit OrderedIndex(KeyFunc key) : m_key(key) {}
+
+    void Update(EntityID id, const T &component) override
     {
-        auto &component_map = GetComponentMap<T>();
-        auto it = component_map.find(id);
-        if (it != component_map.end())
+        Key key = m_key(component);
+        auto it = m_keys.find(id);
+        if (it != m_keys.end())
         {
-            auto &component_storage = GetComponentStorage<T>();
-            auto index = it->second;
-            component_storage.erase(component_storage.begin() + index);
-            component_map.erase(it);
-            for (auto &entity : m_entities)
+            if (it->second == key)
             {
-                auto &entity_component_map = GetComponentMap<T>();
-                if (entity_component_map.find(entity.GetID()) != entity_component_map.end() && entity_component_map[entity.GetID()] > index)
-                {
-                    --entity_component_map[entity.GetID()];
-                }
+                return;
             }
+            m_entries.erase(Entry{it->second, id});
+            it->second = key;
+        }
+        else
+        {
+            m_keys.emplace(id, key);
         }
+        m_entries.emplace(key, id);
     }
 
-    // Get component of entity with given ID
-    template <typename T>
-    T *GetComponent(EntityID id)
+    void Remove(EntityID id) override
     {
-        auto &component_map = GetComponentMap<T>();
-        auto it = component_map.find(id);
-        if (it != component_map.end())
+        auto it = m_keys.find(id);
+        if (it != m_keys.end())
         {
-            return &GetComponentStorage<T>()[it->second];
+            m_entries.erase(Entry{it->second, id});
+            m_keys.erase(it);
         }
-        return nullptr;
     }
 
-    // Get all entities
-    const std::vector<EntityID> GetEntities() const
+    bool Empty() const { return m_entries.empty(); }
+
+    // Entry with the smallest key, nullptr if the index is empty
+    const Entry *First() const
     {
-        std::vector<EntityID> result;
-        for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
-        {
-            result.push_back(it->GetID());
-        }
+        return m_entries.empty() ? nullptr : &*m_entries.begin();
+    }
 
-        return result;
+    // Entry with the largest key, nullptr if the index is empty
+    const Entry *Last() const
+    {
+        return m_entries.empty() ? nullptr : &*m_entries.rbegin();
     }
 
 private:
-    // Define entity class
-    class Entity
-    {
-    public:
-        Entity(EntityID id) : m_id(id) {}
-        EntityID GetID() const { return m_id; }
+    KeyFunc m_key;
+    std::set<Entry> m_entries;
+    std::unordered_map<EntityID, Key> m_keys;
+};
 
-    private:
-        EntityID m_id;
-    };
+// Bucketed index: entities grouped by a key, each bucket kept sorted by a second field
+template <typename T, typename Key, typename Order>
+class BucketIndex : public TypedComponentIndex<T>
+{
+public:
+    using KeyFunc = std::function<Key(const T &)>;
+    using OrderFunc = std::function<Order(const T &)>;
+    using Bucket = std::set<std::pair<Order, EntityID>>;
 
-    // Get component storage of given type
-    template <typename T>
-    ComponentStorage<T> &GetComponentStorage()
+    BucketIndex(KeyFunc key, OrderFunc order) : m_key(key), m_order(order) {}
+
+    void Update(EntityID id, const T &component) override
     {
-        static ComponentStorage<T> storage;
-        return storage;
+        Remove(id);
+        Key key = m_key(component);
+        Order order = m_order(component);
+        m_buckets[key].emplace(order, id);
+        m_keys.emplace(id, std::make_pair(key, order));
     }
 
-    // Get component map of given type
-    template <typename T>
-    std::unordered_map<EntityID, size_t> &GetComponentMap()
+    void Remove(EntityID id) override
     {
-        static std::unordered_map<EntityID, size_t> component_map;
-        return component_map;
+        auto it = m_keys.find(id);
+        if (it == m_keys.end())
+        {
+            return;
+        }
+        auto bucket = m_buckets.find(it->second.first);
+        bucket->second.erase({it->second.second, id});
+        if (bucket->second.empty())
+        {
+            m_buckets.erase(bucket);
+        }
+        m_keys.erase(it);
     }
 
-    // Store entities
-    std::vector<Entity> m_entities;
-};
+    // Entities with the given key sorted by order, nullptr if there are none
+    const Bucket *GetBucket(Key key) const
+    {
+        auto it = m_buckets.find(key);
+        return it == m_buckets.end() ? nullptr : &it->second;
+    }
 
-struct PlayerComponent
-{
-    std::string name;
-    int health;
+private:
+    KeyFunc m_key;
+    OrderFunc m_order;
+    std::unordered_map<Key, Bucket> m_buckets;
+    std::unordered_map<EntityID, std::pair<Key, Order>> m_keys;
 };
 
-struct EnemyComponent
+// Axis-aligned box by its corners, boxes that only touch do not overlap
+struct Aabb
 {
-    int health;
+    float minX, minY, maxX, maxY;
 };
 
-// Define components
-struct PositionComponent
+// Narrowphase kernel: bit i of the result is set if box overlaps candidate i, for up to 64 candidates
+using OverlapKernel = uint64_t (*)(const Aabb &box, const float *minX, const float *minY, const float *maxX, const float *maxY, size_t count);
+
+inline uint64_t OverlapScalar(const Aabb &box, const float *minX, const float *minY, const float *maxX, const float *maxY, size_t count)
 {
-    float x, y;
-};
-struct ProjectileComponent
+    uint64_t mask = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (box.minX < maxX[i] && minX[i] < box.maxX && box.minY < maxY[i] && minY[i] < box.maxY)
+        {
+            mask |= uint64_t(1) << i;
+        }
+    }
+    return mask;
+}
+
+#ifdef SPACEINVADER_X86_SIMD
+#if defined(__GNUC__)
+#define SPACEINVADER_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SPACEINVADER_TARGET(isa)
+#endif
+
+// 4 candidates per compare
+SPACEINVADER_TARGET("sse2")
+inline uint64_t OverlapSSE2(const Aabb &box, const float *minX, const float *minY, const float *maxX, const float *maxY, size_t count)
 {
-    int damage;
-};
+    const __m128 boxMinX = _mm_set1_ps(box.minX), boxMinY = _mm_set1_ps(box.minY);
+    const __m128 boxMaxX = _mm_set1_ps(box.maxX), boxMaxY = _mm_set1_ps(box.maxY);
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_and_ps(_mm_cmplt_ps(boxMinX, _mm_loadu_ps(maxX + i)), _mm_cmplt_ps(_mm_loadu_ps(minX + i), boxMaxX));
+        __m128 y = _mm_and_ps(_mm_cmplt_ps(boxMinY, _mm_loadu_ps(maxY + i)), _mm_cmplt_ps(_mm_loadu_ps(minY + i), boxMaxY));
+        mask |= static_cast<uint64_t>(_mm_movemask_ps(_mm_and_ps(x, y))) << i;
+    }
+    if (i < count)
+    {
+        mask |= OverlapScalar(box, minX + i, minY + i, maxX + i, maxY + i, count - i) << i;
+    }
+    return mask;
+}
 
-struct SpriteComponent
+// 8 candidates per compare
+SPACEINVADER_TARGET("avx2")
+inline uint64_t OverlapAVX2(const Aabb &box, const float *minX, const float *minY, const float *maxX, const float *maxY, size_t count)
 {
-    std::string filepath;
-    SDL_Texture *texture;
-    int w, h;
-};
+    const __m256 boxMinX = _mm256_set1_ps(box.minX), boxMinY = _mm256_set1_ps(box.minY);
+    const __m256 boxMaxX = _mm256_set1_ps(box.maxX), boxMaxY = _mm256_set1_ps(box.maxY);
+    uint64_t mask = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x = _mm256_and_ps(_mm256_cmp_ps(boxMinX, _mm256_loadu_ps(maxX + i), _CMP_LT_OQ), _mm256_cmp_ps(_mm256_loadu_ps(minX + i), boxMaxX, _CMP_LT_OQ));
+        __m256 y = _mm256_and_ps(_mm256_cmp_ps(boxMinY, _mm256_loadu_ps(maxY + i), _CMP_LT_OQ), _mm256_cmp_ps(_mm256_loadu_ps(minY + i), boxMaxY, _CMP_LT_OQ));
+        mask |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_and_ps(x, y))) << i;
+    }
+    if (i < count)
+    {
+        mask |= OverlapSSE2(box, minX + i, minY + i, maxX + i, maxY + i, count - i) << i;
+    }
+    return mask;
+}
+#endif
 
-struct TextComponent
+// Widest kernel the CPU running the game supports
+inline OverlapKernel SelectOverlapKernel()
 {
-    std::string text;
-    std::string font;
-    int size;
-    SDL_Texture *texture;
-};
+#ifdef SPACEINVADER_X86_SIMD
+    if (SDL_HasAVX2())
+    {
+        return OverlapAVX2;
+    }
+    if (SDL_HasSSE2())
+    {
+        return OverlapSSE2;
+    }
+#endif
+    return OverlapScalar;
+}
 
-struct VelocityComponent
+// Boxes in structure-of-arrays layout, so the narrowphase tests a whole block of candidates per instruction
+class AabbBatch
 {
-    int x, y;
+public:
+    void Clear()
+    {
+        m_ids.clear();
+        m_masks.clear();
+        m_minX.clear();
+        m_minY.clear();
+        m_maxX.clear();
+        m_maxY.clear();
+    }
+
+    // mask is matched against the accept bits of a query, boxes without a common bit are never reported
+    void Add(EntityID id, const Aabb &box, uint32_t mask = ~0u)
+    {
+        m_ids.push_back(id);
+        m_masks.push_back(mask);
+        m_minX.push_back(box.minX);
+        m_minY.push_back(box.minY);
+        m_maxX.push_back(box.maxX);
+        m_maxY.push_back(box.maxY);
+    }
+
+    size_t Size() const { return m_ids.size(); }
+
+    // Call fn with the ID and box of every box overlapping the given one whose mask shares a bit with accept,
+    // in the order they were added
+    template <typename F>
+    void ForEachOverlap(const Aabb &box, F fn, uint32_t accept = ~0u) const
+    {
+        static const OverlapKernel kernel = SelectOverlapKernel();
+        for (size_t begin = 0; begin < m_ids.size(); begin += 64)
+        {
+            size_t count = std::min<size_t>(64, m_ids.size() - begin);
+            uint64_t mask = kernel(box, &m_minX[begin], &m_minY[begin], &m_maxX[begin], &m_maxY[begin], count);
+            while (mask)
+            {
+                size_t i = begin + std::countr_zero(mask);
+                if (m_masks[i] & accept)
+                {
+                    fn(m_ids[i], Aabb{m_minX[i], m_minY[i], m_maxX[i], m_maxY[i]});
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+
+private:
+    std::vector<EntityID> m_ids;
+    std::vector<uint32_t> m_masks;
+    std::vector<float> m_minX, m_minY, m_maxX, m_maxY;
 };
-struct InputComponent
+
+// Time of impact of a box moving by (dx, dy) against a still target, as a fraction of the move in [0, 1].
+// nullopt if they never overlap during the move. Slab test: the overlap times of both axes must intersect.
+inline std::optional<float> SweepAabb(const Aabb &moving, float dx, float dy, const Aabb &target)
 {
-    bool up;
-    bool down;
-    bool left;
-    bool right;
-    bool spacebar;
-    bool shoot;
-    bool restart;
-    bool quit;
-};
+    float entry = -std::numeric_limits<float>::infinity();
+    float exit = std::numeric_limits<float>::infinity();
+    auto axis = [&entry, &exit](float minA, float maxA, float d, float minB, float maxB)
+    {
+        if (d == 0)
+        {
+            // never moves on this axis, overlaps all the time or never
+            if (!(minA < maxB && minB < maxA))
+            {
+                exit = -std::numeric_limits<float>::infinity();
+            }
+            return;
+        }
+        float first = (d > 0 ? minB - maxA : maxB - minA) / d;
+        float last = (d > 0 ? maxB - minA : minB - maxA) / d;
+        entry = std::max(entry, first);
+        exit = std::min(exit, last);
+    };
+    axis(moving.minX, moving.maxX, dx, target.minX, target.maxX);
+    axis(moving.minY, moving.maxY, dy, target.minY, target.maxY);
+    if (entry >= exit || entry > 1 || exit <= 0)
+    {
+        return std::nullopt;
+    }
+    return std::max(entry, 0.0f);
+}
 
-struct InputSystem
+// Alpha from which a pixel of an image counts as solid for collisions
+const uint8_t PIXEL_MASK_ALPHA = 128;
+
+// Solid pixels of an image at the size it is drawn, one 64-bit word per row with bit x for column x.
+// Tested only once the boxes overlap, a full 64x64 test is at most 64 ANDs of shifted rows.
+class PixelMask
 {
-    void handleEvent(const SDL_Event &event, ECS &ecs)
+public:
+    // Mask of the surface scaled to w x h, at most 64 wide. A mask pixel is solid if any image pixel
+    // it covers is, so thin details survive the downscale. Empty if the pixels cannot be read.
+    static PixelMask FromSurface(SDL_Surface *surface, int w, int h)
     {
-        if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+        PixelMask mask;
+        if (surface == nullptr || w <= 0 || h <= 0 || w > 64)
         {
-            for (auto entity_id : ecs.GetEntities())
+            return mask;
+        }
+        SDL_Surface *rgba = surface->format->format == SDL_PIXELFORMAT_RGBA32 ? surface : SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+        if (rgba == nullptr)
+        {
+            return mask;
+        }
+        if (SDL_LockSurface(rgba) != 0)
+        {
+            if (rgba != surface)
             {
-                InputComponent *input = ecs.GetComponent<InputComponent>(entity_id);
-                if (input)
+                SDL_FreeSurface(rgba);
+            }
+            return mask;
+        }
+        mask.m_width = w;
+        mask.m_rows.assign(h, 0);
+        const uint8_t *pixels = static_cast<const uint8_t *>(rgba->pixels);
+        for (int my = 0; my < h; my++)
+        {
+            // image rows and columns covered by this mask pixel, at least one when scaling up
+            int top = my * rgba->h / h;
+            int bottom = std::max(top + 1, (my + 1) * rgba->h / h);
+            for (int mx = 0; mx < w; mx++)
+            {
+                int left = mx * rgba->w / w;
+                int right = std::max(left + 1, (mx + 1) * rgba->w / w);
+                bool solid = false;
+                for (int y = top; y < bottom && !solid; y++)
                 {
-                    switch (event.key.keysym.sym)
+                    for (int x = left; x < right && !solid; x++)
                     {
-                    case SDLK_UP:
-                        input->up = event.type == SDL_KEYDOWN;
-                        break;
-                    case SDLK_DOWN:
-                        input->down = event.type == SDL_KEYDOWN;
-                        break;
-                    case SDLK_LEFT:
-                        input->left = event.type == SDL_KEYDOWN;
-                        break;
-                    case SDLK_RIGHT:
-                        input->right = event.type == SDL_KEYDOWN;
-                        break;
-                    case SDLK_RETURN:
-                        input->restart = event.type == SDL_KEYDOWN;
-                        break;
-                    case SDLK_SPACE:
-                        input->shoot = (event.type == SDL_KEYDOWN && !input->spacebar);
-                        input->spacebar = (event.type == SDL_KEYDOWN);
-                        break;
-                    case SDLK_ESCAPE:
-                        input->quit = event.type == SDL_KEYDOWN;
-                        break;
+                        // RGBA32 keeps the bytes in R, G, B, A order on every platform
+                        solid = pixels[y * rgba->pitch + x * 4 + 3] >= PIXEL_MASK_ALPHA;
                     }
                 }
+                if (solid)
+                {
+                    mask.m_rows[my] |= uint64_t(1) << mx;
+                }
+            }
+        }
+        SDL_UnlockSurface(rgba);
+        if (rgba != surface)
+        {
+            SDL_FreeSurface(rgba);
+        }
+        return mask;
+    }
+
+    bool Empty() const { return m_rows.empty(); }
+    int Width() const { return m_width; }
+    int Height() const { return static_cast<int>(m_rows.size()); }
+    uint64_t Row(int y) const { return m_rows[y]; }
+
+    // Whether solid pixels of a at (ax, ay) and b at (bx, by) cover the same screen pixel
+    static bool Overlap(const PixelMask &a, int ax, int ay, const PixelMask &b, int bx, int by)
+    {
+        int top = std::max(ay, by);
+        int bottom = std::min(ay + a.Height(), by + b.Height());
+        int shift = bx - ax;
+        if (shift >= 64 || shift <= -64)
+        {
+            return false;
+        }
+        for (int y = top; y < bottom; y++)
+        {
+            // move b's row into a's columns, screen column ax + i is bit i of a and bit i - shift of b
+            uint64_t row = b.Row(y - by);
+            row = shift >= 0 ? row << shift : row >> -shift;
+            if (a.Row(y - ay) & row)
+            {
+                return true;
             }
         }
+        return false;
+    }
+
+private:
+    int m_width = 0;
+    std::vector<uint64_t> m_rows;
+};
+
+// Uniform grid broadphase: boxes are binned into every square cell they overlap.
+// A query only tests the boxes that share a cell with it instead of every box of the world.
+class SpatialHash
+{
+public:
+    explicit SpatialHash(float cellSize) : m_cellSize(cellSize) {}
+
+    // Empty every cell, their memory is kept for the next build
+    void Clear()
+    {
+        for (auto &cell : m_cells)
+        {
+            cell.second.Clear();
+        }
+    }
+
+    void Insert(EntityID id, const Aabb &box, uint32_t mask = ~0u)
+    {
+        ForEachCell(box, [this, id, &box, mask](uint64_t key)
+                    { m_cells[key].Add(id, box, mask); });
+    }
+
+    // Call fn with the ID and box of every box overlapping the given one whose mask shares a bit with accept.
+    // A box spanning several cells may come more than once. Read only, so any number of threads may query at once.
+    template <typename F>
+    void ForEachOverlap(const Aabb &box, F fn, uint32_t accept = ~0u) const
+    {
+        ForEachCell(box, [this, &box, &fn, accept](uint64_t key)
+                    {
+            auto it = m_cells.find(key);
+            if (it != m_cells.end())
+            {
+                it->second.ForEachOverlap(box, fn, accept);
+            } });
+    }
+
+private:
+    template <typename F>
+    void ForEachCell(const Aabb &box, F fn) const
+    {
+        int left = static_cast<int>(std::floor(box.minX / m_cellSize));
+        int right = static_cast<int>(std::floor(box.maxX / m_cellSize));
+        int top = static_cast<int>(std::floor(box.minY / m_cellSize));
+        int bottom = static_cast<int>(std::floor(box.maxY / m_cellSize));
+        for (int cy = top; cy <= bottom; cy++)
+        {
+            for (int cx = left; cx <= right; cx++)
+            {
+                fn((static_cast<uint64_t>(static_cast<uint32_t>(cx)) << 32) | static_cast<uint32_t>(cy));
+            }
+        }
+    }
+
+    float m_cellSize;
+    std::unordered_map<uint64_t, AabbBatch> m_cells;
+};
+
+// Sweep and prune broadphase: boxes are kept sorted by their left edge across ticks, and a sweep along x
+// pairs every box with the ones starting before its right edge. Things here move little per tick, so the
+// insertion sort that restores the order is close to O(n), and unlike a grid it does not care about box sizes.
+class SweepAndPrune
+{
+public:
+    // Start a tick, boxes not set again before End are dropped
+    void Begin()
+    {
+        m_tick++;
+    }
+
+    // Add a box or move it to where it is this tick
+    void Set(EntityID id, const Aabb &box, uint32_t layer, uint32_t mask)
+    {
+        auto it = m_slots.find(id);
+        if (it != m_slots.end())
+        {
+            Entry &entry = m_entries[it->second];
+            entry.box = box;
+            entry.layer = layer;
+            entry.mask = mask;
+            entry.tick = m_tick;
+        }
+        else
+        {
+            m_slots.emplace(id, m_entries.size());
+            m_entries.push_back(Entry{id, layer, mask, m_tick, box});
+        }
+    }
+
+    // Drop the boxes not set this tick and restore the order, new boxes were appended at the end
+    void End()
+    {
+        m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [this](const Entry &entry)
+                                       { return entry.tick != m_tick; }),
+                        m_entries.end());
+        for (size_t i = 1; i < m_entries.size(); i++)
+        {
+            Entry entry = m_entries[i];
+            size_t j = i;
+            for (; j > 0 && entry.box.minX < m_entries[j - 1].box.minX; j--)
+            {
+                m_entries[j] = m_entries[j - 1];
+            }
+            m_entries[j] = entry;
+        }
+        m_slots.clear();
+        for (size_t i = 0; i < m_entries.size(); i++)
+        {
+            m_slots.emplace(m_entries[i].id, i);
+        }
+    }
+
+    // Call fn(id, box, layer, otherId, otherBox, otherLayer) for every overlapping pair that
+    // wanted(layer, mask, otherLayer, otherMask) accepts, the filter runs before the y test
+    template <typename Wanted, typename F>
+    void ForEachPair(Wanted wanted, F fn) const
+    {
+        for (size_t i = 0; i < m_entries.size(); i++)
+        {
+            const Entry &first = m_entries[i];
+            for (size_t j = i + 1; j < m_entries.size() && m_entries[j].box.minX < first.box.maxX; j++)
+            {
+                const Entry &second = m_entries[j];
+                if (wanted(first.layer, first.mask, second.layer, second.mask) && first.box.minY < second.box.maxY && second.box.minY < first.box.maxY)
+                {
+                    fn(first.id, first.box, first.layer, second.id, second.box, second.layer);
+                }
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        EntityID id;
+        uint32_t layer;
+        uint32_t mask;
+        uint32_t tick;
+        Aabb box;
+    };
+
+    std::vector<Entry> m_entries;
+    std::unordered_map<EntityID, size_t> m_slots;
+    uint32_t m_tick = 0;
+};
+
+// Dynamic bounding volume hierarchy: every box is a leaf of a binary tree whose inner nodes bound their children,
+// kept balanced by rotations as leaves come and go. A leaf keeps a fat box, its box grown by a margin and stretched
+// along its last movement, so a collider creeping along stays inside it for many ticks and moving it costs nothing.
+// Unlike a grid it does not care how large the boxes are or how far apart they lie.
+class DynamicAabbTree
+{
+public:
+    // Proxy of no leaf
+    static const int NIL = -1;
+
+    // margin is how far a fat box reaches past the box on every side
+    explicit DynamicAabbTree(float margin = 8) : m_margin(margin) {}
+
+    // Add a box, returns the proxy to move or remove it by
+    int Insert(EntityID id, const Aabb &box, uint32_t mask = ~0u)
+    {
+        int leaf = Allocate();
+        Node &node = m_nodes[leaf];
+        node.id = id;
+        node.box = box;
+        node.fat = Fatten(box, 0, 0);
+        node.mask = mask;
+        node.height = 0;
+        InsertLeaf(leaf);
+        return leaf;
+    }
+
+    void Remove(int proxy)
+    {
+        RemoveLeaf(proxy);
+        Free(proxy);
+    }
+
+    // Put a box that moved by (dx, dy) at box. The leaf is only taken out and put back in when the box left
+    // its fat box or the mask changed. Returns whether it was.
+    bool Move(int proxy, const Aabb &box, float dx = 0, float dy = 0, uint32_t mask = ~0u)
+    {
+        Node &node = m_nodes[proxy];
+        node.box = box;
+        if (node.mask == mask && node.fat.minX <= box.minX && node.fat.minY <= box.minY && box.maxX <= node.fat.maxX && box.maxY <= node.fat.maxY)
+        {
+            return false;
+        }
+        RemoveLeaf(proxy);
+        node.fat = Fatten(box, dx, dy);
+        node.mask = mask;
+        InsertLeaf(proxy);
+        return true;
+    }
+
+    // Call fn with the ID and box of every box overlapping the given one whose mask shares a bit with accept.
+    // Every box comes at most once. Read only, so any number of threads may query at once.
+    template <typename F>
+    void ForEachOverlap(const Aabb &box, F fn, uint32_t accept = ~0u) const
+    {
+        thread_local std::vector<int> stack;
+        Query(box, fn, accept, stack);
+    }
+
+    // Batch query: fn(index, id, box) for every box overlapping boxes[index], all sharing one traversal stack
+    template <typename F>
+    void ForEachOverlap(const std::vector<Aabb> &boxes, F fn, uint32_t accept = ~0u) const
+    {
+        thread_local std::vector<int> stack;
+        for (size_t i = 0; i < boxes.size(); i++)
+        {
+            auto report = [&fn, i](EntityID id, const Aabb &box)
+            { fn(i, id, box); };
+            Query(boxes[i], report, accept, stack);
+        }
+    }
+
+    // Levels below the root, 0 when empty or a single leaf
+    int Height() const { return m_root == NIL ? 0 : m_nodes[m_root].height; }
+
+private:
+    struct Node
+    {
+        // leaf: the fat box, inner node: the bounds of both children
+        Aabb fat;
+        // leaf only: the box itself
+        Aabb box;
+        EntityID id = 0;
+        // leaf: the box's mask, inner node: the union of the children's
+        uint32_t mask = 0;
+        // next free node while on the free list
+        int parent = NIL;
+        int left = NIL;
+        int right = NIL;
+        // 0 for a leaf, -1 while free
+        int height = -1;
+    };
+
+    static Aabb Union(const Aabb &a, const Aabb &b)
+    {
+        return Aabb{std::min(a.minX, b.minX), std::min(a.minY, b.minY), std::max(a.maxX, b.maxX), std::max(a.maxY, b.maxY)};
+    }
+
+    // Cost of a box for the insertion heuristic, in 2D the perimeter plays the part of the surface area
+    static float Perimeter(const Aabb &box)
+    {
+        return 2 * (box.maxX - box.minX + box.maxY - box.minY);
+    }
+
+    Aabb Fatten(const Aabb &box, float dx, float dy) const
+    {
+        // twice the movement of the tick ahead, a box keeping its speed fits for a few ticks
+        Aabb fat{box.minX - m_margin, box.minY - m_margin, box.maxX + m_margin, box.maxY + m_margin};
+        (dx < 0 ? fat.minX : fat.maxX) += 2 * dx;
+        (dy < 0 ? fat.minY : fat.maxY) += 2 * dy;
+        return fat;
+    }
+
+    int Allocate()
+    {
+        if (m_free == NIL)
+        {
+            m_nodes.emplace_back();
+            return static_cast<int>(m_nodes.size()) - 1;
+        }
+        int index = m_free;
+        m_free = m_nodes[index].parent;
+        m_nodes[index] = Node();
+        return index;
+    }
+
+    void Free(int index)
+    {
+        m_nodes[index].height = -1;
+        m_nodes[index].parent = m_free;
+        m_free = index;
+    }
+
+    bool IsLeaf(int index) const { return m_nodes[index].left == NIL; }
+
+    // Recompute an inner node from its children
+    void Refit(int index)
+    {
+        Node &node = m_nodes[index];
+        const Node &left = m_nodes[node.left];
+        const Node &right = m_nodes[node.right];
+        node.fat = Union(left.fat, right.fat);
+        node.mask = left.mask | right.mask;
+        node.height = 1 + std::max(left.height, right.height);
+    }
+
+    // Point the parent of from, or the root, at to
+    void ReplaceChild(int parent, int from, int to)
+    {
+        if (parent == NIL)
+        {
+            m_root = to;
+        }
+        else if (m_nodes[parent].left == from)
+        {
+            m_nodes[parent].left = to;
+        }
+        else
+        {
+            m_nodes[parent].right = to;
+        }
+    }
+
+    // Refit and rebalance every node from index up to the root
+    void FixUpwards(int index)
+    {
+        while (index != NIL)
+        {
+            index = Balance(index);
+            Refit(index);
+            index = m_nodes[index].parent;
+        }
+    }
+
+    void InsertLeaf(int leaf)
+    {
+        if (m_root == NIL)
+        {
+            m_root = leaf;
+            m_nodes[leaf].parent = NIL;
+            return;
+        }
+
+        // walk down to the sibling that grows the tree's total perimeter the least
+        Aabb fat = m_nodes[leaf].fat;
+        int index = m_root;
+        while (!IsLeaf(index))
+        {
+            const Node &node = m_nodes[index];
+            float combined = Perimeter(Union(node.fat, fat));
+            // pairing with this node makes a new parent, going down grows this node anyway
+            float cost = 2 * combined;
+            float inherited = 2 * (combined - Perimeter(node.fat));
+            auto descend = [&](int child)
+            {
+                const Node &c = m_nodes[child];
+                float grown = Perimeter(Union(c.fat, fat));
+                return (IsLeaf(child) ? grown : grown - Perimeter(c.fat)) + inherited;
+            };
+            float costLeft = descend(node.left);
+            float costRight = descend(node.right);
+            if (cost < costLeft && cost < costRight)
+            {
+                break;
+            }
+            index = costLeft < costRight ? node.left : node.right;
+        }
+
+        int sibling = index;
+        int oldParent = m_nodes[sibling].parent;
+        int newParent = Allocate();
+        m_nodes[newParent].parent = oldParent;
+        m_nodes[newParent].left = sibling;
+        m_nodes[newParent].right = leaf;
+        ReplaceChild(oldParent, sibling, newParent);
+        m_nodes[sibling].parent = newParent;
+        m_nodes[leaf].parent = newParent;
+        FixUpwards(newParent);
+    }
+
+    void RemoveLeaf(int leaf)
+    {
+        if (leaf == m_root)
+        {
+            m_root = NIL;
+            return;
+        }
+        // the sibling takes the place of the parent
+        int parent = m_nodes[leaf].parent;
+        int grandParent = m_nodes[parent].parent;
+        int sibling = m_nodes[parent].left == leaf ? m_nodes[parent].right : m_nodes[parent].left;
+        ReplaceChild(grandParent, parent, sibling);
+        m_nodes[sibling].parent = grandParent;
+        Free(parent);
+        FixUpwards(grandParent);
+    }
+
+    // Rotate the taller grandchild up if the children of a differ in height by more than one, returns the node now in a's place
+    int Balance(int a)
+    {
+        if (IsLeaf(a) || m_nodes[a].height < 2)
+        {
+            return a;
+        }
+        int b = m_nodes[a].left;
+        int c = m_nodes[a].right;
+        int balance = m_nodes[c].height - m_nodes[b].height;
+        if (balance > 1)
+        {
+            return Rotate(a, c, false);
+        }
+        if (balance < -1)
+        {
+            return Rotate(a, b, true);
+        }
+        return a;
+    }
+
+    // Make child the parent of a, child keeps its taller child and hands the other one to a
+    int Rotate(int a, int child, bool leftChild)
+    {
+        int f = m_nodes[child].left;
+        int g = m_nodes[child].right;
+        int taller = m_nodes[f].height > m_nodes[g].height ? f : g;
+        int shorter = taller == f ? g : f;
+
+        m_nodes[child].parent = m_nodes[a].parent;
+        ReplaceChild(m_nodes[a].parent, a, child);
+        m_nodes[a].parent = child;
+        m_nodes[child].left = a;
+        m_nodes[child].right = taller;
+        (leftChild ? m_nodes[a].left : m_nodes[a].right) = shorter;
+        m_nodes[shorter].parent = a;
+        Refit(a);
+        Refit(child);
+        return child;
+    }
+
+    // Depth first walk on the given stack, from its current top so a query may run inside another one's fn
+    template <typename F>
+    void Query(const Aabb &box, F &fn, uint32_t accept, std::vector<int> &stack) const
+    {
+        if (m_root == NIL)
+        {
+            return;
+        }
+        size_t base = stack.size();
+        stack.push_back(m_root);
+        while (stack.size() > base)
+        {
+            const Node &node = m_nodes[stack.back()];
+            stack.pop_back();
+            if (!(node.mask & accept) || !(box.minX < node.fat.maxX && node.fat.minX < box.maxX && box.minY < node.fat.maxY && node.fat.minY < box.maxY))
+            {
+                continue;
+            }
+            if (node.left == NIL)
+            {
+                if (box.minX < node.box.maxX && node.box.minX < box.maxX && box.minY < node.box.maxY && node.box.minY < box.maxY)
+                {
+                    fn(node.id, node.box);
+                }
+            }
+            else
+            {
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+    }
+
+    float m_margin;
+    std::vector<Node> m_nodes;
+    int m_root = NIL;
+    // head of the free list, linked through parent
+    int m_free = NIL;
+};
+
+// Handle of a scheduled timer, safe to cancel or query after the timer fired
+struct TimerHandle
+{
+    uint32_t index = std::numeric_limits<uint32_t>::max();
+    uint32_t generation = 0;
+};
+
+// Hierarchical timing wheel counting simulation ticks, schedule and cancel are O(1).
+// Level n has SLOTS slots of SLOTS^n ticks each; a timer is filed in the finest level that covers its delay
+// and moves down one level each time the wheel above wraps onto its slot.
+class TimerWheel
+{
+public:
+    using Callback = std::function<void()>;
+
+    TimerWheel()
+    {
+        std::fill(std::begin(m_slots), std::end(m_slots), NIL);
+    }
+
+    // Length of one tick, used to convert seconds to ticks
+    void SetTickSeconds(float tickSeconds) { m_tickSeconds = tickSeconds; }
+
+    // Run callback after the given number of ticks, at least one
+    TimerHandle Schedule(uint64_t delayTicks, Callback callback)
+    {
+        uint32_t index;
+        if (!m_free.empty())
+        {
+            index = m_free.back();
+            m_free.pop_back();
+        }
+        else
+        {
+            index = static_cast<uint32_t>(m_nodes.size());
+            m_nodes.emplace_back();
+        }
+        Node &node = m_nodes[index];
+        node.callback = std::move(callback);
+        node.expires = m_now + std::max<uint64_t>(1, delayTicks);
+        Insert(index);
+        return TimerHandle{index, node.generation};
+    }
+
+    TimerHandle ScheduleSeconds(float seconds, Callback callback)
+    {
+        return Schedule(static_cast<uint64_t>(std::ceil(seconds / m_tickSeconds)), std::move(callback));
+    }
+
+    // Drop a pending timer, returns false if it already fired or was cancelled
+    bool Cancel(TimerHandle handle)
+    {
+        if (!IsPending(handle))
+        {
+            return false;
+        }
+        Unlink(handle.index);
+        Release(handle.index);
+        return true;
+    }
+
+    bool IsPending(TimerHandle handle) const
+    {
+        return handle.index < m_nodes.size() && m_nodes[handle.index].generation == handle.generation && m_nodes[handle.index].slot != NIL;
+    }
+
+    // Advance one tick and fire the timers expiring on it
+    void Tick()
+    {
+        m_now++;
+        // when a level wraps, the next slot of the level above is redistributed into the finer levels
+        for (int level = 1; level < LEVELS && SlotOf(m_now, level - 1) == 0; level++)
+        {
+            Cascade(level, SlotOf(m_now, level));
+        }
+
+        uint32_t &head = m_slots[SlotOf(m_now, 0)];
+        while (head != NIL)
+        {
+            uint32_t index = head;
+            Unlink(index);
+            // the callback may schedule new timers and reallocate the node pool
+            Callback callback = std::move(m_nodes[index].callback);
+            Release(index);
+            callback();
+        }
+    }
+
+    uint64_t Now() const { return m_now; }
+
+private:
+    static const int SLOT_BITS = 6;
+    static const uint32_t SLOTS = 1 << SLOT_BITS;
+    // 64^4 ticks, more than a day at 120 Hz
+    static const int LEVELS = 4;
+    static constexpr uint32_t NIL = std::numeric_limits<uint32_t>::max();
+
+    struct Node
+    {
+        Callback callback;
+        uint64_t expires = 0;
+        uint32_t prev = NIL;
+        uint32_t next = NIL;
+        // index into m_slots while pending, NIL when free
+        uint32_t slot = NIL;
+        uint32_t generation = 0;
+    };
+
+    static uint32_t SlotOf(uint64_t tick, int level)
+    {
+        return static_cast<uint32_t>((tick >> (level * SLOT_BITS)) & (SLOTS - 1));
+    }
+
+    void Insert(uint32_t index)
+    {
+        Node &node = m_nodes[index];
+        const uint64_t maxDelay = (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
+        uint64_t delay = node.expires - m_now;
+        // timers beyond the last level wait in it and are filed again when it wraps
+        uint64_t expires = delay > maxDelay ? m_now + maxDelay : node.expires;
+        delay = expires - m_now;
+        int level = 0;
+        while (level < LEVELS - 1 && delay >= (uint64_t(1) << ((level + 1) * SLOT_BITS)))
+        {
+            level++;
+        }
+        uint32_t slot = level * SLOTS + SlotOf(expires, level);
+        node.slot = slot;
+        node.prev = NIL;
+        node.next = m_slots[slot];
+        if (node.next != NIL)
+        {
+            m_nodes[node.next].prev = index;
+        }
+        m_slots[slot] = index;
+    }
+
+    void Unlink(uint32_t index)
+    {
+        Node &node = m_nodes[index];
+        if (node.prev != NIL)
+        {
+            m_nodes[node.prev].next = node.next;
+        }
+        else
+        {
+            m_slots[node.slot] = node.next;
+        }
+        if (node.next != NIL)
+        {
+            m_nodes[node.next].prev = node.prev;
+        }
+        node.slot = NIL;
+    }
+
+    void Release(uint32_t index)
+    {
+        m_nodes[index].generation++;
+        m_free.push_back(index);
+    }
+
+    void Cascade(int level, uint32_t slot)
+    {
+        uint32_t index = m_slots[level * SLOTS + slot];
+        m_slots[level * SLOTS + slot] = NIL;
+        while (index != NIL)
+        {
+            uint32_t next = m_nodes[index].next;
+            Insert(index);
+            index = next;
+        }
+    }
+
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_free;
+    uint32_t m_slots[LEVELS * SLOTS];
+    uint64_t m_now = 0;
+    float m_tickSeconds = 1.0f / 120;
+};
+
+// Define ECS class
+class ECS
+{
+public:
+    // Structural changes recorded by one thread and applied later by ECS::Flush
+    class CommandBuffer
+    {
+    public:
+        CommandBuffer(ECS &ecs) : m_ecs(ecs) {}
+
+        // Commands recorded after this are ordered by the given key when flushed.
+        // Use a key that does not depend on thread timing, e.g. the ID of the entity being processed.
+        void SetSortKey(uint64_t key) { m_sortKey = key; }
+
+        // Reserve an entity ID now, the entity becomes visible at the next flush
+        EntityID CreateEntity()
+        {
+            EntityID id = m_ecs.ReserveEntityID();
+            Record([id](ECS &ecs)
+                   { ecs.AddEntity(id); });
+            return id;
+        }
+
+        void DestroyEntity(EntityID id)
+        {
+            Record([id](ECS &ecs)
+                   { ecs.DestroyEntity(id); });
+        }
+
+        template <typename T>
+        void AddComponent(EntityID id, T component)
+        {
+            Record([id, component](ECS &ecs)
+                   { ecs.AddComponent<T>(id, component); });
+        }
+
+        template <typename T>
+        void RemoveComponent(EntityID id)
+        {
+            Record([id](ECS &ecs)
+                   { ecs.RemoveComponent<T>(id); });
+        }
+
+    private:
+        friend class ECS;
+
+        struct Command
+        {
+            uint64_t sortKey;
+            uint32_t sequence;
+            std::function<void(ECS &)> apply;
+        };
+
+        void Record(std::function<void(ECS &)> apply)
+        {
+            m_commands.push_back(Command{m_sortKey, static_cast<uint32_t>(m_commands.size()), std::move(apply)});
+        }
+
+        ECS &m_ecs;
+        uint64_t m_sortKey = 0;
+        std::vector<Command> m_commands;
+    };
+
+    ECS() : m_worldId(s_nextWorldId.fetch_add(1)) {}
+
+    // Reserve a fresh entity ID, safe to call from any thread
+    EntityID ReserveEntityID()
+    {
+        return m_nextEntityId.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Create entity with given ID
+    EntityID CreateEntity()
+    {
+        EntityID id = ReserveEntityID();
+        AddEntity(id);
+        return id;
+    }
+
+    // Timers of this world, advanced once per simulation tick by the TimerSystem
+    TimerWheel &GetTimers() { return m_timers; }
+
+    // Entity exists and was not destroyed
+    bool IsAlive(EntityID id) const
+    {
+        return m_entityIndex.count(id) != 0;
+    }
+
+    // Command buffer of the calling thread, created on its first use
+    CommandBuffer &GetCommandBuffer()
+    {
+        // one cached buffer per thread, the map is only touched when the thread switches world
+        thread_local uint64_t cachedWorld = 0;
+        thread_local CommandBuffer *cachedBuffer = nullptr;
+        if (cachedBuffer == nullptr || cachedWorld != m_worldId)
+        {
+            std::lock_guard<std::mutex> lock(m_commandBufferMutex);
+            auto &buffer = m_commandBuffers[std::this_thread::get_id()];
+            if (!buffer)
+            {
+                buffer = std::make_unique<CommandBuffer>(*this);
+            }
+            cachedWorld = m_worldId;
+            cachedBuffer = buffer.get();
+        }
+        return *cachedBuffer;
+    }
+
+    // Sync point: apply the changes recorded on every thread.
+    // Commands run ordered by sort key, then recording order, so the result does not depend on which thread recorded them.
+    void Flush()
+    {
+        PROFILE_ZONE("ECS::Flush");
+        std::vector<CommandBuffer::Command *> commands;
+        {
+            std::lock_guard<std::mutex> lock(m_commandBufferMutex);
+            for (auto &buffer : m_commandBuffers)
+            {
+                for (auto &command : buffer.second->m_commands)
+                {
+                    commands.push_back(&command);
+                }
+            }
+        }
+        std::sort(commands.begin(), commands.end(), [](const CommandBuffer::Command *a, const CommandBuffer::Command *b)
+                  { return a->sortKey != b->sortKey ? a->sortKey < b->sortKey : a->sequence < b->sequence; });
+        for (auto command : commands)
+        {
+            command->apply(*this);
+        }
+        std::lock_guard<std::mutex> lock(m_commandBufferMutex);
+        for (auto &buffer : m_commandBuffers)
+        {
+            buffer.second->m_commands.clear();
+        }
+    }
+
+    // Destroy entity with given ID
+    void DestroyEntity(EntityID id)
+    {
+        // O(1): the last entity takes the slot of the destroyed one
+        auto it = m_entityIndex.find(id);
+        if (it != m_entityIndex.end())
+        {
+            size_t slot = it->second;
+            m_entityIndex.erase(it);
+            if (slot != m_entities.size() - 1)
+            {
+                m_entities[slot] = m_entities.back();
+                m_entityIndex[m_entities[slot].GetID()] = slot;
+            }
+            m_entities.pop_back();
+        }
+        for (auto &pool : m_pools)
+        {
+            if (pool)
+            {
+                pool->Remove(id);
+            }
+        }
+        for (auto &index : m_indices)
+        {
+            index->Remove(id);
+        }
+    }
+
+    // Add component to entity with given ID, replaces the one it already has
+    template <typename T>
+    void AddComponent(EntityID id, T component)
+    {
+        auto &pool = GetOrCreatePool<T>();
+        auto it = pool.map.find(id);
+        if (it != pool.map.end())
+        {
+            pool.storage[it->second] = component;
+        }
+        else
+        {
+            pool.storage.emplace_back(component);
+            pool.owners.push_back(id);
+            pool.map[id] = pool.storage.size() - 1;
+        }
+        UpdateIndices<T>(id, component);
+    }
+
+    // Declare an ordered index on a field of component T, filled from the existing components
+    template <typename T, typename Key>
+    OrderedIndex<T, Key> &AddOrderedIndex(typename OrderedIndex<T, Key>::KeyFunc key)
+    {
+        return RegisterIndex<T>(std::make_unique<OrderedIndex<T, Key>>(key));
+    }
+
+    // Declare a bucketed index on a field of component T, each bucket sorted by a second field
+    template <typename T, typename Key, typename Order>
+    BucketIndex<T, Key, Order> &AddBucketIndex(typename BucketIndex<T, Key, Order>::KeyFunc key,
+                                               typename BucketIndex<T, Key, Order>::OrderFunc order)
+    {
+        return RegisterIndex<T>(std::make_unique<BucketIndex<T, Key, Order>>(key, order));
+    }
+
+    // Remove component from entity with given ID
+    template <typename T>
+    void RemoveComponent(EntityID id)
+    {
+        auto pool = FindPool<T>();
+        if (pool && pool->Remove(id))
+        {
+            for (auto typed_index : m_typedIndices[std::type_index(typeid(T))])
+            {
+                typed_index->Remove(id);
+            }
+        }
+    }
+
+    // Get component of entity with given ID
+    template <typename T>
+    T *GetComponent(EntityID id)
+    {
+        auto pool = FindPool<T>();
+        if (pool == nullptr)
+        {
+            return nullptr;
+        }
+        auto it = pool->map.find(id);
+        if (it != pool->map.end())
+        {
+            return &pool->storage[it->second];
+        }
+        return nullptr;
+    }
+
+    // Entities that have all of the given components, with pointers to them.
+    // The pointers stay valid until the next structural change, so the view can be processed in parallel.
+    template <typename... Ts>
+    std::vector<std::tuple<EntityID, Ts *...>> View()
+    {
+        std::vector<std::tuple<EntityID, Ts *...>> result;
+        for (auto &entity : m_entities)
+        {
+            std::tuple<Ts *...> components{GetComponent<Ts>(entity.GetID())...};
+            if (((std::get<Ts *>(components) != nullptr) && ...))
+            {
+                result.emplace_back(entity.GetID(), std::get<Ts *>(components)...);
+            }
+        }
+        return result;
+    }
+
+    // Get all entities
+    const std::vector<EntityID> GetEntities() const
+    {
+        std::vector<EntityID> result;
+        for (auto it = m_entities.begin(); it != m_entities.end(); ++it)
+        {
+            result.push_back(it->GetID());
+        }
+
+        return result;
+    }
+
+private:
+    // Define entity class
+    class Entity
+    {
+    public:
+        Entity(EntityID id) : m_id(id) {}
+        EntityID GetID() const { return m_id; }
+
+    private:
+        EntityID m_id;
+    };
+
+    // Type-erased base of the component pools, lets DestroyEntity drop every component of an entity
+    struct ComponentPoolBase
+    {
+        virtual ~ComponentPoolBase() = default;
+        virtual bool Remove(EntityID id) = 0;
+    };
+
+    // Components of one type, packed in a vector and found through the entity map
+    template <typename T>
+    struct ComponentPool : ComponentPoolBase
+    {
+        ComponentStorage<T> storage;
+        std::vector<EntityID> owners;
+        std::unordered_map<EntityID, size_t> map;
+
+        // Move the last component into the hole, so removal is O(1)
+        bool Remove(EntityID id) override
+        {
+            auto it = map.find(id);
+            if (it == map.end())
+            {
+                return false;
+            }
+            size_t index = it->second;
+            map.erase(it);
+            if (index != storage.size() - 1)
+            {
+                storage[index] = std::move(storage.back());
+                owners[index] = owners.back();
+                map[owners[index]] = index;
+            }
+            storage.pop_back();
+            owners.pop_back();
+            return true;
+        }
+    };
+
+    // Pool of the given type, nullptr if no such component was ever added. Safe to call from parallel readers.
+    template <typename T>
+    ComponentPool<T> *FindPool()
+    {
+        ComponentID id = GetComponentID<T>();
+        if (id >= m_pools.size())
+        {
+            return nullptr;
+        }
+        return static_cast<ComponentPool<T> *>(m_pools[id].get());
+    }
+
+    // Pool of the given type, created on first use. Only call where structural changes are allowed.
+    template <typename T>
+    ComponentPool<T> &GetOrCreatePool()
+    {
+        ComponentID id = GetComponentID<T>();
+        if (id >= m_pools.size())
+        {
+            m_pools.resize(id + 1);
+        }
+        if (!m_pools[id])
+        {
+            m_pools[id] = std::make_unique<ComponentPool<T>>();
+        }
+        return static_cast<ComponentPool<T> &>(*m_pools[id]);
+    }
+
+    void AddEntity(EntityID id)
+    {
+        m_entityIndex.emplace(id, m_entities.size());
+        m_entities.emplace_back(id);
+    }
+
+    // Take ownership of an index and fill it with every entity that already has a T
+    template <typename T, typename Index>
+    Index &RegisterIndex(std::unique_ptr<Index> index)
+    {
+        Index &result = *index;
+        for (auto &entity : m_entities)
+        {
+            T *component = GetComponent<T>(entity.GetID());
+            if (component)
+            {
+                result.Update(entity.GetID(), *component);
+            }
+        }
+        m_typedIndices[std::type_index(typeid(T))].push_back(index.get());
+        m_indices.push_back(std::move(index));
+        return result;
+    }
+
+    // Refresh all indices declared on component T for the given entity
+    template <typename T>
+    void UpdateIndices(EntityID id, const T &component)
+    {
+        auto it = m_typedIndices.find(std::type_index(typeid(T)));
+        if (it != m_typedIndices.end())
+        {
+            for (auto index : it->second)
+            {
+                static_cast<TypedComponentIndex<T> *>(index)->Update(id, component);
+            }
+        }
+    }
+
+    // Store entities
+    // live entities, densely packed in no particular order
+    std::vector<Entity> m_entities;
+    // slot of every live entity in m_entities
+    std::unordered_map<EntityID, size_t> m_entityIndex;
+
+    // Component pools of this world, indexed by component ID
+    std::vector<std::unique_ptr<ComponentPoolBase>> m_pools;
+
+    // Entity IDs are handed out atomically so worker threads can reserve them
+    std::atomic<EntityID> m_nextEntityId{0};
+
+    // Per-thread command buffers, keyed by the recording thread
+    std::mutex m_commandBufferMutex;
+    std::unordered_map<std::thread::id, std::unique_ptr<CommandBuffer>> m_commandBuffers;
+
+    TimerWheel m_timers;
+
+    // Distinguishes worlds in the per-thread command buffer cache
+    uint64_t m_worldId;
+    static inline std::atomic<uint64_t> s_nextWorldId{1};
+
+    // Secondary indices, owned here and grouped by the component type they index
+    std::vector<std::unique_ptr<ComponentIndexBase>> m_indices;
+    std::unordered_map<std::type_index, std::vector<ComponentIndexBase *>> m_typedIndices;
+};
+
+struct PlayerComponent
+{
+    std::string name;
+    int health;
+    // pending while the weapon reloads
+    TimerHandle weaponCooldown{};
+    // pending while enemies cannot hurt the player
+    TimerHandle invulnerable{};
+};
+
+struct EnemyComponent
+{
+    int health;
+};
+
+// Slot of an enemy in the invader grid
+struct FormationComponent
+{
+    int column;
+    int row;
+};
+
+// Define components
+struct PositionComponent
+{
+    float x, y;
+};
+// Position at the previous simulation tick, rendering interpolates from it to PositionComponent
+struct PreviousPositionComponent
+{
+    float x, y;
+};
+struct ProjectileComponent
+{
+    int damage;
+    // set once it hit something, it is removed at the end of the tick
+    bool spent = false;
+    // removes it once PROJECTILE_LIFETIME_SECONDS passed, cancelled if it is destroyed before
+    TimerHandle lifetime{};
+};
+
+// Seconds between two shots of the player
+const float WEAPON_COOLDOWN_SECONDS = 0.25f;
+// Seconds the player cannot be hurt again after a hit
+const float INVULNERABLE_SECONDS = 2.0f;
+// Seconds after which a projectile is removed even if it never left the screen
+const float PROJECTILE_LIFETIME_SECONDS = 10.0f;
+
+// What a collider belongs to
+enum CollisionLayer
+{
+    COLLISION_LAYER_PLAYER,
+    COLLISION_LAYER_ENEMY,
+    COLLISION_LAYER_PROJECTILE,
+    COLLISION_LAYER_COUNT,
+};
+
+constexpr uint32_t LayerBit(int layer)
+{
+    return uint32_t(1) << layer;
+}
+
+// Which layers collide with which, the row of a layer holds the bits of the layers it touches.
+// Keep it symmetric: a pair is only tested if both rows agree.
+const uint32_t COLLISION_TABLE[COLLISION_LAYER_COUNT] = {
+    // player
+    LayerBit(COLLISION_LAYER_ENEMY),
+    // enemy
+    LayerBit(COLLISION_LAYER_PLAYER) | LayerBit(COLLISION_LAYER_PROJECTILE),
+    // projectile
+    LayerBit(COLLISION_LAYER_ENEMY),
+};
+
+// Collision box of an entity, placed at its position plus the offset
+struct ColliderComponent
+{
+    float w, h;
+    float offsetX, offsetY;
+    CollisionLayer layer;
+    // layers this collider accepts on top of the table, clear bits to make it ignore a layer
+    uint32_t mask = ~0u;
+    // solid pixels of its sprite at the collider's size, nullptr to collide as a full box
+    const PixelMask *shape = nullptr;
+};
+
+// Whether a collider of the first layer and mask may touch one of the other layer and mask
+inline bool ShouldCollide(uint32_t layer, uint32_t mask, uint32_t otherLayer, uint32_t otherMask)
+{
+    return (COLLISION_TABLE[layer] & mask & LayerBit(otherLayer)) && (COLLISION_TABLE[otherLayer] & otherMask & LayerBit(layer));
+}
+
+// Box of the collider in screen space
+inline Aabb ColliderBox(const PositionComponent &position, const ColliderComponent &collider)
+{
+    float x = position.x + collider.offsetX;
+    float y = position.y + collider.offsetY;
+    return Aabb{x, y, x + collider.w, y + collider.h};
+}
+
+struct SpriteComponent
+{
+    std::string filepath;
+    SDL_Texture *texture;
+    int w, h;
+    // part of the texture to draw, all of it if empty
+    SDL_Rect source{0, 0, 0, 0};
+};
+
+struct TextComponent
+{
+    std::string text;
+    std::string font;
+    int size;
+};
+
+// Where the sprite of an entity goes in the draw order: its RenderSnapshot::Layer, and within the layer
+// and texture higher depths are drawn later. Entities without one draw at depth 0 of LAYER_SPRITES.
+// A text of the entity stays on LAYER_TEXT above every sprite, ordered by the same depth.
+struct RenderLayerComponent
+{
+    int layer;
+    int depth;
+};
+
+struct VelocityComponent
+{
+    int x, y;
+};
+struct InputComponent
+{
+    bool up;
+    bool down;
+    bool left;
+    bool right;
+    bool spacebar;
+    bool shoot;
+    bool restart;
+    bool quit;
+};
+
+// Components a system reads and writes, the scheduler runs systems in parallel only if these do not conflict
+struct SystemAccess
+{
+    std::set<std::type_index> reads;
+    std::set<std::type_index> writes;
+    // creates or destroys entities directly instead of through a command buffer
+    bool structural = false;
+
+    template <typename T>
+    SystemAccess &Read()
+    {
+        reads.insert(std::type_index(typeid(T)));
+        return *this;
+    }
+
+    template <typename T>
+    SystemAccess &Write()
+    {
+        writes.insert(std::type_index(typeid(T)));
+        return *this;
+    }
+
+    SystemAccess &Structural()
+    {
+        structural = true;
+        return *this;
+    }
+
+    bool ConflictsWith(const SystemAccess &other) const
+    {
+        if (structural || other.structural)
+        {
+            return true;
+        }
+        for (auto &type : writes)
+        {
+            if (other.reads.count(type) || other.writes.count(type))
+            {
+                return true;
+            }
+        }
+        for (auto &type : other.writes)
+        {
+            if (reads.count(type))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Bytes of view entries handed to one task by JobSystem::ParallelForEach, sized to stay in L1
+const size_t JOB_CHUNK_BYTES = 32 * 1024;
+
+// Tasks started together, JobSystem::Wait returns once all of them finished
+class TaskGroup
+{
+    friend class JobSystem;
+    std::atomic<size_t> m_pending{0};
+};
+
+// Work-stealing task scheduler.
+// Every worker owns a deque: it pushes and pops its own tasks at the back while idle workers steal
+// from the front of the others. Threads that are not workers submit into one extra shared deque.
+// Waiting threads run pending tasks instead of blocking, so tasks may start and wait for sub-tasks.
+class JobSystem
+{
+public:
+    JobSystem(size_t workers) : m_queues(workers + 1)
+    {
+        for (size_t i = 0; i < workers; i++)
+        {
+            m_workers.emplace_back([this, i]
+                                   { Worker(i); });
+        }
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto &worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t WorkerCount() const { return m_workers.size(); }
+
+    // Start a task as part of the group
+    void Run(TaskGroup &group, std::function<void()> task)
+    {
+        group.m_pending.fetch_add(1);
+        {
+            // counted before the push so a concurrent take never sees the counter below the deque size
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_queued++;
+        }
+        {
+            Queue &queue = m_queues[LocalQueue()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(Task{std::move(task), &group});
+        }
+        m_wake.notify_one();
+    }
+
+    // Run pending tasks until every task of the group finished
+    void Wait(TaskGroup &group)
+    {
+        while (group.m_pending.load() > 0)
+        {
+            Task task;
+            if (TryTake(LocalQueue(), task))
+            {
+                Execute(task);
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Call fn for every entry of the view, split into chunks that run as separate tasks
+    template <typename View, typename F>
+    void ParallelForEach(View &view, F fn)
+    {
+        const size_t chunk = std::max<size_t>(64, JOB_CHUNK_BYTES / sizeof(view[0]));
+        if (view.size() <= chunk)
+        {
+            for (auto &entry : view)
+            {
+                fn(entry);
+            }
+            return;
+        }
+        TaskGroup group;
+        for (size_t begin = 0; begin < view.size(); begin += chunk)
+        {
+            size_t end = std::min(view.size(), begin + chunk);
+            Run(group, [&view, &fn, begin, end]
+                {
+                PROFILE_ZONE("ParallelForEach chunk");
+                for (size_t i = begin; i < end; i++)
+                {
+                    fn(view[i]);
+                } });
+        }
+        Wait(group);
+    }
+
+private:
+    struct Task
+    {
+        std::function<void()> function;
+        TaskGroup *group;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Deque of the calling thread, the shared one for threads outside the pool
+    size_t LocalQueue() const
+    {
+        return t_owner == this ? t_workerIndex : m_workers.size();
+    }
+
+    // Pop the newest task of our own deque, otherwise steal the oldest task of another one
+    bool TryTake(size_t local, Task &task)
+    {
+        for (size_t i = 0; i < m_queues.size(); i++)
+        {
+            size_t index = (local + i) % m_queues.size();
+            Queue &queue = m_queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                if (index == local)
+                {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                }
+                else
+                {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                std::lock_guard<std::mutex> sleepLock(m_sleepMutex);
+                m_queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Execute(Task &task)
+    {
+        task.function();
+        task.group->m_pending.fetch_sub(1);
+    }
+
+    void Worker(size_t index)
+    {
+        t_owner = this;
+        t_workerIndex = index;
+        PROFILE_THREAD("Job worker");
+        while (true)
+        {
+            Task task;
+            if (TryTake(index, task))
+            {
+                Execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_wake.wait(lock, [this]
+                        { return m_stop || m_queued > 0; });
+            if (m_stop)
+            {
+                return;
+            }
+        }
+    }
+
+    std::vector<Queue> m_queues;
+    std::vector<std::thread> m_workers;
+
+    // Number of queued tasks over all deques, idle workers sleep while it is zero
+    size_t m_queued = 0;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+
+    static inline thread_local const JobSystem *t_owner = nullptr;
+    static inline thread_local size_t t_workerIndex = 0;
+};
+
+// Runs the simulation systems as a dependency graph built from their declared component access.
+// A system depends on every earlier registered system it conflicts with, so conflicting systems
+// keep the registration order and the others run concurrently on the job system.
+class SystemScheduler
+{
+public:
+    SystemScheduler(JobSystem &jobs) : m_jobs(jobs) {}
+
+    void AddSystem(std::string name, SystemAccess access, std::function<void(float)> update)
+    {
+        Node node{name, access, update, {}, 0};
+        for (size_t i = 0; i < m_nodes.size(); i++)
+        {
+            if (m_nodes[i].access.ConflictsWith(access))
+            {
+                m_nodes[i].successors.push_back(m_nodes.size());
+                node.dependencies++;
+            }
+        }
+        m_nodes.push_back(node);
+    }
+
+    // Run every system once and wait for all of them
+    void Run(float deltaTime)
+    {
+        m_pending = std::make_unique<std::atomic<size_t>[]>(m_nodes.size());
+        for (size_t i = 0; i < m_nodes.size(); i++)
+        {
+            m_pending[i] = m_nodes[i].dependencies;
+        }
+        TaskGroup group;
+        for (size_t i = 0; i < m_nodes.size(); i++)
+        {
+            if (m_nodes[i].dependencies == 0)
+            {
+                Schedule(group, i, deltaTime);
+            }
+        }
+        m_jobs.Wait(group);
+    }
+
+private:
+    struct Node
+    {
+        std::string name;
+        SystemAccess access;
+        std::function<void(float)> update;
+        std::vector<size_t> successors;
+        size_t dependencies;
+    };
+
+    void Schedule(TaskGroup &group, size_t index, float deltaTime)
+    {
+        m_jobs.Run(group, [this, &group, index, deltaTime]
+                   {
+            m_nodes[index].update(deltaTime);
+            for (auto successor : m_nodes[index].successors)
+            {
+                if (--m_pending[successor] == 0)
+                {
+                    Schedule(group, successor, deltaTime);
+                }
+            }
+        });
+    }
+
+    JobSystem &m_jobs;
+    std::vector<Node> m_nodes;
+    std::unique_ptr<std::atomic<size_t>[]> m_pending;
+};
+
+// Gameplay script written as a C++20 coroutine, suspended with co_await NextFrame() or co_await Seconds(s)
+class Script
+{
+public:
+    struct promise_type
+    {
+        Script get_return_object() { return Script(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        // scripts start suspended and first run at the next ScriptSystem::Update
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Script(Script &&other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    ~Script()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    // Hand the coroutine over to the script system
+    std::coroutine_handle<> Release() { return std::exchange(m_handle, nullptr); }
+
+private:
+    explicit Script(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+// Owns the running scripts and resumes them on the simulation clock.
+// Suspended scripts wait in a min-heap ordered by wake time, so an update only touches the scripts that are due.
+class ScriptSystem
+{
+public:
+    ~ScriptSystem()
+    {
+        while (!m_waiting.empty())
+        {
+            m_waiting.top().handle.destroy();
+            m_waiting.pop();
+        }
+    }
+
+    // Scripts create and destroy entities directly
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Structural();
+    }
+
+    // Run the script from the next update on
+    void Start(Script script)
+    {
+        Schedule(script.Release(), m_time);
+    }
+
+    void Update(float deltaTime)
+    {
+        PROFILE_ZONE("ScriptSystem::Update");
+        m_time += deltaTime;
+        m_deltaTime = deltaTime;
+
+        // scripts scheduled while resuming wait for the next update, even if already due
+        m_due.clear();
+        while (!m_waiting.empty() && m_waiting.top().wakeTime <= m_time)
+        {
+            m_due.push_back(m_waiting.top().handle);
+            m_waiting.pop();
+        }
+
+        ScriptSystem *previous = t_current;
+        t_current = this;
+        for (auto handle : m_due)
+        {
+            handle.resume();
+            if (handle.done())
+            {
+                handle.destroy();
+            }
+        }
+        t_current = previous;
+    }
+
+    // Number of suspended scripts
+    size_t Count() const { return m_waiting.size(); }
+
+    // Used by the awaitables of the scripts being resumed
+    static ScriptSystem &Current() { return *t_current; }
+    double Time() const { return m_time; }
+    float DeltaTime() const { return m_deltaTime; }
+
+    void Schedule(std::coroutine_handle<> handle, double wakeTime)
+    {
+        m_waiting.push(Waiting{wakeTime, m_order++, handle});
+    }
+
+private:
+    struct Waiting
+    {
+        double wakeTime;
+        // scripts due at the same time resume in the order they were scheduled
+        uint64_t order;
+        std::coroutine_handle<> handle;
+
+        bool operator>(const Waiting &other) const
+        {
+            return wakeTime != other.wakeTime ? wakeTime > other.wakeTime : order > other.order;
+        }
+    };
+
+    std::priority_queue<Waiting, std::vector<Waiting>, std::greater<Waiting>> m_waiting;
+    std::vector<std::coroutine_handle<>> m_due;
+    uint64_t m_order = 0;
+    double m_time = 0;
+    float m_deltaTime = 0;
+
+    static inline thread_local ScriptSystem *t_current = nullptr;
+};
+
+// co_await NextFrame() resumes the script at the next update and yields that update's delta time
+struct NextFrame
+{
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) const
+    {
+        ScriptSystem::Current().Schedule(handle, ScriptSystem::Current().Time());
+    }
+    float await_resume() const { return ScriptSystem::Current().DeltaTime(); }
+};
+
+// co_await Seconds(s) resumes the script once s seconds of simulation time have passed
+struct Seconds
+{
+    explicit Seconds(float seconds) : m_seconds(seconds) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) const
+    {
+        ScriptSystem::Current().Schedule(handle, ScriptSystem::Current().Time() + m_seconds);
+    }
+    void await_resume() const {}
+
+private:
+    float m_seconds;
+};
+
+struct InputSystem
+{
+    void handleEvent(const SDL_Event &event, ECS &ecs)
+    {
+        if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+        {
+            for (auto entity_id : ecs.GetEntities())
+            {
+                InputComponent *input = ecs.GetComponent<InputComponent>(entity_id);
+                if (input)
+                {
+                    switch (event.key.keysym.sym)
+                    {
+                    case SDLK_UP:
+                        input->up = event.type == SDL_KEYDOWN;
+                        break;
+                    case SDLK_DOWN:
+                        input->down = event.type == SDL_KEYDOWN;
+                        break;
+                    case SDLK_LEFT:
+                        input->left = event.type == SDL_KEYDOWN;
+                        break;
+                    case SDLK_RIGHT:
+                        input->right = event.type == SDL_KEYDOWN;
+                        break;
+                    case SDLK_RETURN:
+                        input->restart = event.type == SDL_KEYDOWN;
+                        break;
+                    case SDLK_SPACE:
+                        // a press stays latched until the projectile system consumes it, even if released within the same tick
+                        input->shoot = input->shoot || (event.type == SDL_KEYDOWN && !input->spacebar);
+                        input->spacebar = (event.type == SDL_KEYDOWN);
+                        break;
+                    case SDLK_ESCAPE:
+                        input->quit = event.type == SDL_KEYDOWN;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+};
+
+class EnemyMovementSystem
+{
+    const float speed = 5.0f;
+
+    // Formation columns in order, the first and last hold the enemies closest to the walls
+    OrderedIndex<FormationComponent, int> &m_columns;
+    // Enemies of each column sorted by row, the last one is the lowest
+    BucketIndex<FormationComponent, int, int> &m_columnRows;
+
+    JobSystem &m_jobs;
+
+public:
+    EnemyMovementSystem(ECS &ecs, JobSystem &jobs)
+        : m_columns(ecs.AddOrderedIndex<FormationComponent, int>([](const FormationComponent &f)
+                                                                 { return f.column; })),
+          m_columnRows(ecs.AddBucketIndex<FormationComponent, int, int>([](const FormationComponent &f)
+                                                                        { return f.column; },
+                                                                        [](const FormationComponent &f)
+                                                                        { return f.row; })),
+          m_jobs(jobs)
+    {
+    }
+
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Read<EnemyComponent>().Read<FormationComponent>().Read<ColliderComponent>().Write<PositionComponent>().Write<VelocityComponent>();
+    }
+
+    // Lowest enemy of the given column, the only one with a free line of fire
+    std::optional<EntityID> LowestInColumn(int column) const
+    {
+        auto bucket = m_columnRows.GetBucket(column);
+        if (bucket == nullptr)
+        {
+            return std::nullopt;
+        }
+        return bucket->rbegin()->second;
+    }
+
+    // Horizontal extent and speed of the formation, nullopt once every enemy left it
+    struct FormationBounds
+    {
+        float left;
+        float right;
+        float velocity;
+    };
+
+    // The outermost columns are the only ones that can touch a wall, one enemy of each gives the extent
+    std::optional<FormationBounds> Bounds(ECS &ecs) const
+    {
+        if (m_columns.Empty())
+        {
+            return std::nullopt;
+        }
+        EntityID leftmost = m_columns.First()->second;
+        EntityID rightmost = m_columns.Last()->second;
+        PositionComponent *left = ecs.GetComponent<PositionComponent>(leftmost);
+        PositionComponent *right = ecs.GetComponent<PositionComponent>(rightmost);
+        ColliderComponent *leftCollider = ecs.GetComponent<ColliderComponent>(leftmost);
+        ColliderComponent *rightCollider = ecs.GetComponent<ColliderComponent>(rightmost);
+        VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(leftmost);
+        if (left == nullptr || right == nullptr || leftCollider == nullptr || rightCollider == nullptr || velocity == nullptr)
+        {
+            return std::nullopt;
+        }
+        return FormationBounds{ColliderBox(*left, *leftCollider).minX, ColliderBox(*right, *rightCollider).maxX, static_cast<float>(velocity->x)};
+    }
+
+    // Update entity with given ID
+    void Update(float deltaTime, ECS &ecs)
+    {
+        PROFILE_ZONE("EnemyMovementSystem::Update");
+        // the wall is checked once for the whole formation, before it moves.
+        // Only a step into a wall bounces, so a formation still touching it after the flip cannot bounce again.
+        bool bounce = false;
+        if (auto bounds = Bounds(ecs))
+        {
+            float step = bounds->velocity * deltaTime;
+            bounce = (step < 0 && bounds->left + step < 10) || (step > 0 && bounds->right + step > SCREEN_WIDTH);
+        }
+        auto enemies = ecs.View<EnemyComponent, PositionComponent, VelocityComponent>();
+        m_jobs.ParallelForEach(enemies, [deltaTime, bounce](auto &entry)
+                               {
+            auto [entity_id, enemy, position, velocity] = entry;
+            if (bounce)
+            {
+                // all enemy one line down and reverse direction
+                position->y += 64;
+                velocity->x = velocity->x * -1;
+            }
+            else
+            {
+                position->x += velocity->x * deltaTime;
+            } });
+
+        // destruction is recorded per enemy and applied at the next ECS::Flush, divers included
+        auto targets = ecs.View<EnemyComponent, PositionComponent>();
+        m_jobs.ParallelForEach(targets, [&ecs](auto &entry)
+                               {
+            auto [entity_id, enemy, position] = entry;
+            if (position->y > SCREEN_HEIGHT)
+            {
+                EventLog() << "Enemy out of screen:" << entity_id << std::endl;
+                ECS::CommandBuffer &commands = ecs.GetCommandBuffer();
+                commands.SetSortKey(entity_id);
+                commands.DestroyEntity(entity_id);
+            } });
+    }
+};
+
+// Enemies leaving the formation to dive at the player
+const float DIVE_SPEED = 150.0f;
+// Seconds between two attempts to dive of an enemy blocked by the ones below it
+const float DIVE_RETRY_SECONDS = 2.0f;
+
+// Part of an atlas page holding one image
+struct AtlasRegion
+{
+    SDL_Texture *texture = nullptr;
+    SDL_Rect rect{0, 0, 0, 0};
+};
+
+// Skyline bottom-left rectangle packer: the tops of the placed rectangles form a skyline of horizontal segments,
+// and every rectangle goes where it rests lowest on it, then leftmost
+class SkylinePacker
+{
+public:
+    SkylinePacker(int width, int height) : m_width(width), m_height(height), m_skyline{Segment{0, 0, width}} {}
+
+    // Find room for a w x h rectangle, false if the page has none left
+    bool Insert(int w, int h, SDL_Rect &placed)
+    {
+        int bestY = m_height;
+        size_t best = m_skyline.size();
+        for (size_t i = 0; i < m_skyline.size(); i++)
+        {
+            int y = Fit(i, w, h);
+            if (y >= 0 && y < bestY)
+            {
+                bestY = y;
+                best = i;
+            }
+        }
+        if (best == m_skyline.size())
+        {
+            return false;
+        }
+        placed = SDL_Rect{m_skyline[best].x, bestY, w, h};
+        m_used.w = std::max(m_used.w, placed.x + w);
+        m_used.h = std::max(m_used.h, bestY + h);
+
+        // the new segment covers the ones it rests on, shorten or drop them
+        m_skyline.insert(m_skyline.begin() + best, Segment{placed.x, bestY + h, w});
+        for (size_t i = best + 1; i < m_skyline.size();)
+        {
+            int covered = m_skyline[i - 1].x + m_skyline[i - 1].w - m_skyline[i].x;
+            if (covered <= 0)
+            {
+                break;
+            }
+            m_skyline[i].x += covered;
+            m_skyline[i].w -= covered;
+            if (m_skyline[i].w > 0)
+            {
+                break;
+            }
+            m_skyline.erase(m_skyline.begin() + i);
+        }
+        for (size_t i = 0; i + 1 < m_skyline.size();)
+        {
+            if (m_skyline[i].y == m_skyline[i + 1].y)
+            {
+                m_skyline[i].w += m_skyline[i + 1].w;
+                m_skyline.erase(m_skyline.begin() + i + 1);
+            }
+            else
+            {
+                i++;
+            }
+        }
+        return true;
+    }
+
+    // Smallest size holding everything placed so far
+    int UsedWidth() const { return m_used.w; }
+    int UsedHeight() const { return m_used.h; }
+
+private:
+    struct Segment
+    {
+        int x, y, w;
+    };
+
+    // Height a w x h rectangle rests at when its left edge is on segment index, -1 if it does not fit there
+    int Fit(size_t index, int w, int h) const
+    {
+        if (m_skyline[index].x + w > m_width)
+        {
+            return -1;
+        }
+        int y = 0;
+        for (int remaining = w; remaining > 0; index++)
+        {
+            y = std::max(y, m_skyline[index].y);
+            if (y + h > m_height)
+            {
+                return -1;
+            }
+            remaining -= m_skyline[index].w;
+        }
+        return y;
+    }
+
+    int m_width, m_height;
+    std::vector<Segment> m_skyline;
+    SDL_Rect m_used{0, 0, 0, 0};
+};
+
+// Packs the sprite images into as few textures as possible at startup, so sprites drawn one after another
+// share a texture and the renderer does not have to switch between them.
+// Images are stored at the size they are drawn at: the renderer samples nearest, so scaling
+// them once here looks the same as scaling every frame, and the whole set fits a small page.
+class TextureAtlas
+{
+public:
+    // Side of a page, an image bigger than that gets a page of its own
+    explicit TextureAtlas(int pageSize = 1024) : m_pageSize(pageSize) {}
+
+    ~TextureAtlas()
+    {
+        for (SDL_Surface *image : m_images)
+        {
+            SDL_FreeSurface(image);
+        }
+    }
+
+    TextureAtlas(const TextureAtlas &) = delete;
+    TextureAtlas &operator=(const TextureAtlas &) = delete;
+
+    // Queue a copy of the surface scaled to w x h, returns the index of its region or -1 if it could not be copied
+    int Add(SDL_Surface *surface, int w, int h)
+    {
+        SDL_Surface *image = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32);
+        if (image == nullptr)
+        {
+            std::cout << "SDL_CreateRGBSurfaceWithFormat Error: " << SDL_GetError() << std::endl;
+            return -1;
+        }
+        // copy the alpha instead of blending onto the transparent image
+        SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_NONE);
+        SDL_Rect dstRect{0, 0, w, h};
+        if (SDL_BlitScaled(surface, NULL, image, &dstRect) != 0)
+        {
+            std::cout << "SDL_BlitScaled Error: " << SDL_GetError() << std::endl;
+            SDL_FreeSurface(image);
+            return -1;
+        }
+        // copied onto the page as is too, blending would darken the edges of the sprite
+        SDL_SetSurfaceBlendMode(image, SDL_BLENDMODE_NONE);
+        m_images.push_back(image);
+        m_regions.emplace_back();
+        return static_cast<int>(m_regions.size()) - 1;
+    }
+
+    // Pack every queued image and upload the pages, tallest images first. False if a page could not be created.
+    bool Build(SDL_Renderer *renderer)
+    {
+        std::vector<size_t> order(m_images.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [this](size_t l, size_t r)
+                  { return std::make_pair(m_images[l]->h, m_images[l]->w) > std::make_pair(m_images[r]->h, m_images[r]->w); });
+
+        std::vector<SkylinePacker> packers;
+        std::vector<size_t> pageOf(m_images.size());
+        for (size_t index : order)
+        {
+            // one pixel apart, so filtering never picks up a neighbour
+            int w = m_images[index]->w + ATLAS_PADDING;
+            int h = m_images[index]->h + ATLAS_PADDING;
+            size_t page = 0;
+            while (page < packers.size() && !packers[page].Insert(w, h, m_regions[index].rect))
+            {
+                page++;
+            }
+            if (page == packers.size())
+            {
+                packers.emplace_back(std::max(m_pageSize, w), std::max(m_pageSize, h));
+                packers.back().Insert(w, h, m_regions[index].rect);
+            }
+            m_regions[index].rect.w -= ATLAS_PADDING;
+            m_regions[index].rect.h -= ATLAS_PADDING;
+            pageOf[index] = page;
+        }
+
+        bool built = true;
+        for (size_t page = 0; page < packers.size(); page++)
+        {
+            SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, packers[page].UsedWidth(), packers[page].UsedHeight(), 32, SDL_PIXELFORMAT_RGBA32);
+            if (surface == nullptr)
+            {
+                std::cout << "SDL_CreateRGBSurfaceWithFormat Error: " << SDL_GetError() << std::endl;
+                built = false;
+                continue;
+            }
+            for (size_t index = 0; index < m_images.size(); index++)
+            {
+                if (pageOf[index] == page)
+                {
+                    SDL_Rect dstRect = m_regions[index].rect;
+                    SDL_BlitSurface(m_images[index], NULL, surface, &dstRect);
+                }
+            }
+            SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+            SDL_FreeSurface(surface);
+            if (texture == nullptr)
+            {
+                std::cout << "SDL_CreateTextureFromSurface Error: " << SDL_GetError() << std::endl;
+                built = false;
+                continue;
+            }
+            SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+            m_pages.push_back(texture);
+            for (size_t index = 0; index < m_images.size(); index++)
+            {
+                if (pageOf[index] == page)
+                {
+                    m_regions[index].texture = texture;
+                }
+            }
+        }
+        for (SDL_Surface *image : m_images)
+        {
+            SDL_FreeSurface(image);
+        }
+        m_images.clear();
+        return built;
+    }
+
+    const AtlasRegion &Region(int index) const { return m_regions[index]; }
+    size_t Pages() const { return m_pages.size(); }
+
+    // Destroy the page textures, before the renderer they belong to
+    void Destroy()
+    {
+        for (SDL_Texture *texture : m_pages)
+        {
+            SDL_DestroyTexture(texture);
+        }
+        m_pages.clear();
+    }
+
+private:
+    static const int ATLAS_PADDING = 1;
+
+    int m_pageSize;
+    std::vector<SDL_Surface *> m_images;
+    std::vector<AtlasRegion> m_regions;
+    std::vector<SDL_Texture *> m_pages;
+};
+
+// Sprites of the game objects in the atlas and the pixel masks of their colliders.
+// The regions have no texture when running headless, a mask is nullptr if its image could not be read.
+struct GameTextures
+{
+    AtlasRegion player;
+    AtlasRegion enemy;
+    AtlasRegion projectile;
+    const PixelMask *playerMask = nullptr;
+    const PixelMask *enemyMask = nullptr;
+    const PixelMask *projectileMask = nullptr;
+};
+
+// splitmix64 finalizer: nearby inputs come out unrelated over all 64 bits
+inline uint64_t SplitMix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Seed of one random stream of a game, e.g. the one of an enemy, so no two games or streams start alike
+inline uint64_t MixSeed(uint64_t seed, uint64_t stream)
+{
+    return SplitMix64(SplitMix64(seed) ^ stream);
+}
+
+// Progress of one game, written by the wave script
+struct GameState
+{
+    // seeds the enemies' random behaviour, so games with the same seed play out the same
+    unsigned seed = 0;
+    // wave currently fought
+    int wave = 0;
+    // waves wiped out or escaped off screen
+    int wavesCleared = 0;
+    // points for the enemies shot down
+    int score = 0;
+};
+
+// Per-enemy behaviour: after a random delay the enemy leaves the formation, as soon as it is the lowest of
+// its column, and dives towards the player until it leaves the screen
+Script EnemyBehaviour(ECS &ecs, EnemyMovementSystem &formation, EntityID enemy_id, EntityID player_id, unsigned seed)
+{
+    std::mt19937 random(static_cast<uint32_t>(MixSeed(seed, enemy_id)));
+    co_await Seconds(std::uniform_real_distribution<float>(5.0f, 30.0f)(random));
+    while (ecs.IsAlive(enemy_id))
+    {
+        auto slot = ecs.GetComponent<FormationComponent>(enemy_id);
+        if (formation.LowestInColumn(slot->column) == enemy_id)
+        {
+            break;
+        }
+        co_await Seconds(DIVE_RETRY_SECONDS);
+    }
+    if (!ecs.IsAlive(enemy_id))
+    {
+        co_return;
+    }
+
+    // out of the formation indices and the formation sweep
+    ecs.RemoveComponent<FormationComponent>(enemy_id);
+    ecs.RemoveComponent<VelocityComponent>(enemy_id);
+    while (ecs.IsAlive(enemy_id))
+    {
+        float deltaTime = co_await NextFrame();
+        if (!ecs.IsAlive(enemy_id))
+        {
+            break;
+        }
+        auto position = ecs.GetComponent<PositionComponent>(enemy_id);
+        auto playerPosition = ecs.IsAlive(player_id) ? ecs.GetComponent<PositionComponent>(player_id) : nullptr;
+        if (playerPosition)
+        {
+            float step = DIVE_SPEED * 0.5f * deltaTime;
+            position->x += std::clamp(playerPosition->x - position->x, -step, step);
+        }
+        position->y += DIVE_SPEED * deltaTime;
+    }
+}
+
+// Spawn the invader grid of the given wave, later waves sweep faster
+void SpawnWave(ECS &ecs, ScriptSystem &scripts, EnemyMovementSystem &formation, EntityID player_id, const GameTextures &textures, const GameState &state)
+{
+    int textureSize = 64;
+    int enemyLines = 3;
+    for (int j = 0; j < enemyLines; j++)
+    {
+        int column = 0;
+        for (int i = 10; i < SCREEN_WIDTH - textureSize; i += (textureSize * 2), column++)
+        {
+            EntityID enemy_id = ecs.CreateEntity();
+
+            std::stringstream ss;
+            ss << enemy_id;
+            ecs.AddComponent(enemy_id, PositionComponent{(float)i, (float)j * textureSize});
+            ecs.AddComponent(enemy_id, SpriteComponent{"", textures.enemy.texture, 64, 64, textures.enemy.rect});
+            ecs.AddComponent(enemy_id, TextComponent{ss.str().c_str(), "resources/arial.ttf", 10});
+            ecs.AddComponent(enemy_id, VelocityComponent{50 + 10 * (state.wave - 1), 0});
+            ecs.AddComponent(enemy_id, EnemyComponent{1});
+            ecs.AddComponent(enemy_id, FormationComponent{column, j});
+            ecs.AddComponent(enemy_id, ColliderComponent{64, 64, 0, 0, COLLISION_LAYER_ENEMY, ~0u, textures.enemyMask});
+            scripts.Start(EnemyBehaviour(ecs, formation, enemy_id, player_id, state.seed));
+        }
+    }
+}
+
+// Wave script: spawn a wave, wait until it is wiped out, pause, spawn the next one
+Script WaveScript(ECS &ecs, ScriptSystem &scripts, EnemyMovementSystem &formation, EntityID player_id, GameTextures textures, GameState &state)
+{
+    for (state.wave = 1;; state.wave++)
+    {
+        EventLog() << "Wave " << state.wave << std::endl;
+        SpawnWave(ecs, scripts, formation, player_id, textures, state);
+        do
+        {
+            co_await Seconds(0.5f);
+        } while (!ecs.View<EnemyComponent>().empty());
+        state.wavesCleared++;
+        co_await Seconds(2);
+    }
+}
+
+// Define systems
+class MovementSystem
+{
+    const float speed = 5.0f;
+
+public:
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Read<InputComponent>().Write<PositionComponent>().Write<TextComponent>();
+    }
+
+    // Update entity with given ID
+    void Update(float deltaTime, EntityID player_id, ECS &ecs)
+    {
+        PROFILE_ZONE("MovementSystem::Update");
+        InputComponent *input = ecs.GetComponent<InputComponent>(player_id);
+        PositionComponent *position = ecs.GetComponent<PositionComponent>(player_id);
+        VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(player_id);
+        auto text = ecs.GetComponent<TextComponent>(player_id);
+
+        if (input && position)
+        {
+            if (input->left)
+            {
+                if (position->x > 0)
+                {
+                    position->x -= speed;
+                }
+            }
+            else if (input->right)
+            {
+                if (position->x < SCREEN_WIDTH - 64)
+                {
+                    position->x += speed;
+                }
+            }
+        }
+
+        if (text)
+        {
+            std::stringstream ss;
+            ss << "x:";
+            ss << position->x;
+
+            text->text = ss.str();
+        }
+    }
+};
+
+// Advances the world's timer wheel by one tick, the callbacks may change entities structurally
+class TimerSystem
+{
+public:
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Write<TimerWheel>().Structural();
+    }
+
+    void Update(ECS &ecs)
+    {
+        PROFILE_ZONE("TimerSystem::Update");
+        ecs.GetTimers().Tick();
+    }
+};
+
+// Keeps the previous tick's positions so frames between two ticks can be interpolated
+class InterpolationSystem
+{
+public:
+    // Call before every simulation tick
+    void SavePrevious(ECS &ecs)
+    {
+        PROFILE_ZONE("InterpolationSystem::SavePrevious");
+        for (auto [entity_id, position] : ecs.View<PositionComponent>())
+        {
+            auto previous = ecs.GetComponent<PreviousPositionComponent>(entity_id);
+            if (previous)
+            {
+                *previous = PreviousPositionComponent{position->x, position->y};
+            }
+            else
+            {
+                ecs.AddComponent(entity_id, PreviousPositionComponent{position->x, position->y});
+            }
+        }
+    }
+};
+
+// Immutable copy of everything the renderer needs from one simulation tick
+struct RenderSnapshot
+{
+    // draw order of the snapshot layers
+    enum Layer
+    {
+        LAYER_SPRITES,
+        LAYER_TEXT,
+        LAYER_HUD,
+    };
+
+    struct Sprite
+    {
+        SDL_Texture *texture;
+        SDL_Rect source;
+        float x, y;
+        float prevX, prevY;
+        int w, h;
+        int layer;
+        int depth;
+    };
+
+    struct Text
+    {
+        std::string text;
+        std::string font;
+        int size;
+        float x, y;
+        float prevX, prevY;
+        int layer;
+        int depth;
+    };
+
+    std::vector<Sprite> sprites;
+    std::vector<Text> texts;
+
+    // HUD counters
+    int enemies = 0;
+    int objects = 0;
+
+    // SDL_GetPerformanceCounter() when the snapshot was published and the tick length, to interpolate between ticks
+    uint64_t publishTime = 0;
+    float tickSeconds = 0;
+
+    // the player asked to leave the game
+    bool quit = false;
+
+    // Fraction of a tick elapsed since this snapshot was published, clamped to [0, 1]
+    float Alpha(uint64_t now) const
+    {
+        if (tickSeconds <= 0)
+        {
+            return 1;
+        }
+        double elapsed = static_cast<double>(now - publishTime) / SDL_GetPerformanceFrequency();
+        return std::min(1.0f, static_cast<float>(elapsed / tickSeconds));
+    }
+};
+
+// Lock-free hand-over of the latest value from one writer thread to one reader thread.
+// The writer and the reader each own a slot and swap it with the middle one, so neither ever waits.
+template <typename T>
+class TripleBuffer
+{
+public:
+    // Slot the writer fills before Publish
+    T &WriteBuffer() { return m_slots[m_write]; }
+
+    // Make the write slot the latest value
+    void Publish()
+    {
+        m_write = m_middle.exchange(m_write | NEW_DATA, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Take the latest published value if there is one, returns false if ReadBuffer did not change
+    bool Fetch()
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & NEW_DATA) == 0)
+        {
+            return false;
+        }
+        m_read = m_middle.exchange(m_read, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+
+    // Slot the reader works on, stays valid until the next Fetch
+    const T &ReadBuffer() const { return m_slots[m_read]; }
+
+private:
+    static const int INDEX_MASK = 3;
+    static const int NEW_DATA = 4;
+
+    T m_slots[3];
+    int m_write = 0;
+    std::atomic<int> m_middle{1};
+    int m_read = 2;
+};
+
+// Copies the ECS state the renderer needs into a snapshot, run on the simulation thread
+class SnapshotSystem
+{
+public:
+    void Capture(ECS &ecs, EntityID player_id, RenderSnapshot &snapshot)
+    {
+        PROFILE_ZONE("SnapshotSystem::Capture");
+        snapshot.sprites.clear();
+        snapshot.texts.clear();
+        snapshot.enemies = 0;
+        snapshot.objects = 0;
+        for (auto entity_id : ecs.GetEntities())
+        {
+            auto position = ecs.GetComponent<PositionComponent>(entity_id);
+            auto previous = ecs.GetComponent<PreviousPositionComponent>(entity_id);
+            auto sprite = ecs.GetComponent<SpriteComponent>(entity_id);
+            auto text = ecs.GetComponent<TextComponent>(entity_id);
+            auto order = ecs.GetComponent<RenderLayerComponent>(entity_id);
+            if (position)
+            {
+                // entities spawned during the last tick have no previous position yet
+                float prevX = previous ? previous->x : position->x;
+                float prevY = previous ? previous->y : position->y;
+                int depth = order ? order->depth : 0;
+                if (sprite)
+                {
+                    int layer = order ? order->layer : RenderSnapshot::LAYER_SPRITES;
+                    snapshot.sprites.push_back(RenderSnapshot::Sprite{sprite->texture, sprite->source, position->x, position->y, prevX, prevY, sprite->w, sprite->h, layer, depth});
+                }
+                if (text)
+                {
+                    snapshot.texts.push_back(RenderSnapshot::Text{text->text, text->font, text->size, position->x, position->y, prevX, prevY, RenderSnapshot::LAYER_TEXT, depth});
+                }
+            }
+            if (ecs.GetComponent<EnemyComponent>(entity_id))
+            {
+                snapshot.enemies++;
+            }
+            snapshot.objects++;
+        }
+        auto input = ecs.GetComponent<InputComponent>(player_id);
+        snapshot.quit = input && input->quit;
+    }
+};
+
+// Collects textured quads and draws the consecutive ones sharing a texture with a single SDL_RenderGeometry call,
+// so the sprites of one atlas page cost one call instead of one SDL_RenderCopy each.
+// The vertex and index arrays keep their memory across frames.
+class SpriteBatch
+{
+public:
+    // Queue the source part of texture, all of it if nullptr, drawn at dstRect. Draws the queued quads first
+    // if they use another texture, so sprites still cover each other in the order they were queued.
+    void Draw(SDL_Renderer *renderer, SDL_Texture *texture, const SDL_Rect *source, const SDL_Rect &dstRect)
+    {
+        if (texture != m_texture)
+        {
+            Flush(renderer);
+            m_texture = texture;
+            m_textureW = m_textureH = 0;
+            SDL_QueryTexture(texture, NULL, NULL, &m_textureW, &m_textureH);
+        }
+        if (m_textureW <= 0 || m_textureH <= 0)
+        {
+            return;
+        }
+        float u0 = 0, v0 = 0, u1 = 1, v1 = 1;
+        if (source)
+        {
+            u0 = static_cast<float>(source->x) / m_textureW;
+            v0 = static_cast<float>(source->y) / m_textureH;
+            u1 = static_cast<float>(source->x + source->w) / m_textureW;
+            v1 = static_cast<float>(source->y + source->h) / m_textureH;
+        }
+        float x0 = static_cast<float>(dstRect.x), y0 = static_cast<float>(dstRect.y);
+        float x1 = x0 + dstRect.w, y1 = y0 + dstRect.h;
+        const SDL_Color white{255, 255, 255, 255};
+        m_vertices.push_back(SDL_Vertex{SDL_FPoint{x0, y0}, white, SDL_FPoint{u0, v0}});
+        m_vertices.push_back(SDL_Vertex{SDL_FPoint{x1, y0}, white, SDL_FPoint{u1, v0}});
+        m_vertices.push_back(SDL_Vertex{SDL_FPoint{x1, y1}, white, SDL_FPoint{u1, v1}});
+        m_vertices.push_back(SDL_Vertex{SDL_FPoint{x0, y1}, white, SDL_FPoint{u0, v1}});
+    }
+
+    // Draw the queued quads
+    void Flush(SDL_Renderer *renderer)
+    {
+        if (m_vertices.empty())
+        {
+            return;
+        }
+        // two triangles per quad, the same pattern every frame, so it only grows with the largest batch seen
+        int quads = static_cast<int>(m_vertices.size() / 4);
+        for (int quad = static_cast<int>(m_indices.size() / 6); quad < quads; quad++)
+        {
+            int first = quad * 4;
+            m_indices.insert(m_indices.end(), {first, first + 1, first + 2, first, first + 2, first + 3});
+        }
+        if (SDL_RenderGeometry(renderer, m_texture, m_vertices.data(), static_cast<int>(m_vertices.size()), m_indices.data(), quads * 6) != 0 && !m_reported)
+        {
+            std::cout << "SDL_RenderGeometry Error: " << SDL_GetError() << std::endl;
+            m_reported = true;
+        }
+        m_vertices.clear();
+        // a texture may be destroyed before the next frame and its address reused
+        m_texture = nullptr;
+    }
+
+private:
+    SDL_Texture *m_texture = nullptr;
+    int m_textureW = 0;
+    int m_textureH = 0;
+    std::vector<SDL_Vertex> m_vertices;
+    std::vector<int> m_indices;
+    // a failing call fails every frame, print it once
+    bool m_reported = false;
+};
+
+// Printable ASCII glyphs of one font at one size, rasterized once into a texture together with their advances
+// and kerning, so a string is drawn as a quad per character instead of being rendered and uploaded every frame
+class GlyphAtlas
+{
+public:
+    static const int FIRST_GLYPH = 32;
+    static const int LAST_GLYPH = 126;
+    static const int GLYPH_COUNT = LAST_GLYPH - FIRST_GLYPH + 1;
+
+    // Rasterize the glyphs of the font, nullptr if it cannot be opened or the texture not created
+    static std::unique_ptr<GlyphAtlas> Create(SDL_Renderer *renderer, const std::string &path, int size)
+    {
+        TTF_Font *font = TTF_OpenFont(path.c_str(), size);
+        if (font == nullptr)
+        {
+            std::cout << "TTF_OpenFont Error: " << TTF_GetError() << std::endl;
+            return nullptr;
+        }
+        std::unique_ptr<GlyphAtlas> atlas(new GlyphAtlas());
+        atlas->m_height = TTF_FontHeight(font);
+        std::vector<SDL_Surface *> surfaces(GLYPH_COUNT, nullptr);
+        for (int i = 0; i < GLYPH_COUNT; i++)
+        {
+            Uint16 ch = static_cast<Uint16>(FIRST_GLYPH + i);
+            if (TTF_GlyphIsProvided(font, ch))
+            {
+                // same look as TTF_RenderText_Solid, the pen starts at the left edge of the surface
+                surfaces[i] = TTF_RenderGlyph_Solid(font, ch, {255, 255, 255, 255});
+                TTF_GlyphMetrics(font, ch, NULL, NULL, NULL, NULL, &atlas->m_glyphs[i].advance);
+            }
+            for (int previous = 0; previous < GLYPH_COUNT; previous++)
+            {
+                atlas->m_kerning[previous * GLYPH_COUNT + i] = TTF_GetFontKerningSizeGlyphs(font, static_cast<Uint16>(FIRST_GLYPH + previous), ch);
+            }
+        }
+        TTF_CloseFont(font);
+
+        atlas->m_texture = atlas->Pack(renderer, surfaces);
+        for (SDL_Surface *surface : surfaces)
+        {
+            SDL_FreeSurface(surface);
+        }
+        if (atlas->m_texture == nullptr)
+        {
+            return nullptr;
+        }
+        return atlas;
+    }
+
+    ~GlyphAtlas()
+    {
+        if (m_texture)
+        {
+            SDL_DestroyTexture(m_texture);
+        }
+    }
+
+    GlyphAtlas(const GlyphAtlas &) = delete;
+    GlyphAtlas &operator=(const GlyphAtlas &) = delete;
+
+    int Height() const { return m_height; }
+
+    // Width of text as Draw lays it out
+    int Measure(const std::string &text) const
+    {
+        int width = 0;
+        Layout(text, [&width](const Glyph &glyph, int x)
+               { width = x + glyph.advance; });
+        return width;
+    }
+
+    // Queue the glyphs of text with its top left corner at (x, y), characters the font lacks are skipped
+    void Draw(SDL_Renderer *renderer, SpriteBatch &batch, const std::string &text, int x, int y) const
+    {
+        Layout(text, [&](const Glyph &glyph, int penX)
+               {
+            if (glyph.rect.w > 0)
+            {
+                batch.Draw(renderer, m_texture, &glyph.rect, SDL_Rect{x + penX, y, glyph.rect.w, glyph.rect.h});
+            } });
+    }
+
+private:
+    struct Glyph
+    {
+        // where the glyph is on the texture, empty if it has no pixels
+        SDL_Rect rect{0, 0, 0, 0};
+        int advance = 0;
+    };
+
+    GlyphAtlas() = default;
+
+    // Call fn(glyph, penX) for every character of text that has a glyph
+    template <typename F>
+    void Layout(const std::string &text, F fn) const
+    {
+        int penX = 0;
+        int previous = -1;
+        for (char c : text)
+        {
+            int index = static_cast<unsigned char>(c) - FIRST_GLYPH;
+            if (index < 0 || index >= GLYPH_COUNT)
+            {
+                continue;
+            }
+            if (previous >= 0)
+            {
+                penX += m_kerning[previous * GLYPH_COUNT + index];
+            }
+            fn(m_glyphs[index], penX);
+            penX += m_glyphs[index].advance;
+            previous = index;
+        }
+    }
+
+    // Pack the glyph surfaces into the smallest square page from 128 up that holds them all, and upload it
+    SDL_Texture *Pack(SDL_Renderer *renderer, const std::vector<SDL_Surface *> &surfaces)
+    {
+        std::optional<SkylinePacker> packer;
+        for (int side = 128; side <= 4096 && !packer; side *= 2)
+        {
+            packer.emplace(side, side);
+            for (int i = 0; i < GLYPH_COUNT && packer; i++)
+            {
+                // one pixel apart, so filtering never picks up a neighbour
+                if (surfaces[i] && !packer->Insert(surfaces[i]->w + 1, surfaces[i]->h + 1, m_glyphs[i].rect))
+                {
+                    packer.reset();
+                }
+            }
+        }
+        if (!packer || packer->UsedWidth() == 0)
+        {
+            std::cout << "Glyph atlas does not fit a texture" << std::endl;
+            return nullptr;
+        }
+        SDL_Surface *page = SDL_CreateRGBSurfaceWithFormat(0, packer->UsedWidth(), packer->UsedHeight(), 32, SDL_PIXELFORMAT_RGBA32);
+        if (page == nullptr)
+        {
+            std::cout << "SDL_CreateRGBSurfaceWithFormat Error: " << SDL_GetError() << std::endl;
+            return nullptr;
+        }
+        for (int i = 0; i < GLYPH_COUNT; i++)
+        {
+            if (surfaces[i])
+            {
+                m_glyphs[i].rect.w--;
+                m_glyphs[i].rect.h--;
+                // the color key of the solid glyphs leaves the background transparent
+                SDL_Rect dstRect = m_glyphs[i].rect;
+                SDL_BlitSurface(surfaces[i], NULL, page, &dstRect);
+            }
+        }
+        SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, page);
+        SDL_FreeSurface(page);
+        if (texture == nullptr)
+        {
+            std::cout << "SDL_CreateTextureFromSurface Error: " << SDL_GetError() << std::endl;
+            return nullptr;
+        }
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        return texture;
+    }
+
+    SDL_Texture *m_texture = nullptr;
+    int m_height = 0;
+    Glyph m_glyphs[GLYPH_COUNT];
+    // kerning between every pair of glyphs, previous * GLYPH_COUNT + next
+    std::vector<int> m_kerning = std::vector<int>(GLYPH_COUNT * GLYPH_COUNT, 0);
+};
+
+// Draws texts from one glyph atlas per font and size, built the first time a text uses them
+class TextRenderingSystem
+{
+    // nullptr for fonts that failed, so they are not tried again every frame
+    std::map<std::pair<std::string, int>, std::unique_ptr<GlyphAtlas>> m_atlases;
+
+public:
+    // Glyph atlas of the font at size, nullptr if it cannot be built
+    GlyphAtlas *Atlas(SDL_Renderer *renderer, const std::string &font, int size)
+    {
+        auto [it, inserted] = m_atlases.try_emplace(std::make_pair(font, size));
+        if (inserted)
+        {
+            PROFILE_ZONE("GlyphAtlas::Create");
+            it->second = GlyphAtlas::Create(renderer, font, size);
+        }
+        return it->second.get();
+    }
+
+    // Queue the glyphs of one text of the snapshot
+    void Draw(SDL_Renderer *renderer, SpriteBatch &batch, const RenderSnapshot::Text &text, float alpha)
+    {
+        GlyphAtlas *atlas = Atlas(renderer, text.font, text.size);
+        if (atlas == nullptr)
+        {
+            return;
+        }
+        float x = text.prevX + (text.x - text.prevX) * alpha;
+        float y = text.prevY + (text.y - text.prevY) * alpha;
+        atlas->Draw(renderer, batch, text.text, static_cast<int>(x), static_cast<int>(y - 5));
+    }
+
+    // Destroy the atlas textures, before the renderer they belong to
+    void Destroy()
+    {
+        m_atlases.clear();
+    }
+};
+
+// Draw order of a frame. Every sprite and text of the snapshot gets a 64 bit key of its layer, texture and depth,
+// and the keys are radix sorted: layers cover each other in order, and within a layer the sprites come grouped by
+// texture so the batch can draw them in few calls. The sort is stable, equal keys keep the snapshot order.
+class RenderQueue
+{
+public:
+    struct Item
+    {
+        uint64_t key;
+        // index into the snapshot's sprites or texts
+        uint32_t index;
+        bool text;
+    };
+
+    // Key layout from the top: 8 bits layer, 16 bits texture, 16 bits depth
+    static uint64_t MakeKey(int layer, uint32_t texture, int depth)
+    {
+        uint64_t biasedDepth = static_cast<uint64_t>(std::clamp(depth + 0x8000, 0, 0xFFFF));
+        return (static_cast<uint64_t>(layer & 0xFF) << 56) | (static_cast<uint64_t>(texture & 0xFFFF) << 40) | (biasedDepth << 24);
+    }
+
+    void Build(const RenderSnapshot &snapshot)
+    {
+        PROFILE_ZONE("RenderQueue::Build");
+        m_items.clear();
+        // textures are numbered in the order they first show up, a frame only sees a few atlas pages
+        m_textures.clear();
+        for (uint32_t i = 0; i < snapshot.sprites.size(); i++)
+        {
+            auto &sprite = snapshot.sprites[i];
+            m_items.push_back(Item{MakeKey(sprite.layer, TextureRank(sprite.texture), sprite.depth), i, false});
+        }
+        // texts draw from their glyph atlases, they come after the sprites of their layer
+        for (uint32_t i = 0; i < snapshot.texts.size(); i++)
+        {
+            auto &text = snapshot.texts[i];
+            m_items.push_back(Item{MakeKey(text.layer, 0xFFFF, text.depth), i, true});
+        }
+        RadixSort();
+    }
+
+    const std::vector<Item> &Items() const { return m_items; }
+
+private:
+    uint32_t TextureRank(SDL_Texture *texture)
+    {
+        auto it = std::find(m_textures.begin(), m_textures.end(), texture);
+        if (it != m_textures.end())
+        {
+            return static_cast<uint32_t>(it - m_textures.begin());
+        }
+        m_textures.push_back(texture);
+        return static_cast<uint32_t>(m_textures.size() - 1);
+    }
+
+    // Least significant digit first, a byte per pass. The histograms of all bytes are counted in one go,
+    // and a pass is skipped when every key has the same byte there, like the unused low bytes.
+    void RadixSort()
+    {
+        size_t counts[8][256] = {};
+        for (auto &item : m_items)
+        {
+            for (int digit = 0; digit < 8; digit++)
+            {
+                counts[digit][(item.key >> (digit * 8)) & 0xFF]++;
+            }
+        }
+        m_scratch.resize(m_items.size());
+        for (int digit = 0; digit < 8; digit++)
+        {
+            size_t *count = counts[digit];
+            if (count[(m_items.empty() ? 0 : m_items[0].key >> (digit * 8)) & 0xFF] == m_items.size())
+            {
+                continue;
+            }
+            size_t offset = 0;
+            for (int bucket = 0; bucket < 256; bucket++)
+            {
+                size_t next = offset + count[bucket];
+                count[bucket] = offset;
+                offset = next;
+            }
+            for (auto &item : m_items)
+            {
+                m_scratch[count[(item.key >> (digit * 8)) & 0xFF]++] = item;
+            }
+            m_items.swap(m_scratch);
+        }
+    }
+
+    std::vector<Item> m_items;
+    std::vector<Item> m_scratch;
+    std::vector<SDL_Texture *> m_textures;
+};
+
+class RenderingSystem
+{
+    TextRenderingSystem &m_texts;
+    RenderQueue m_queue;
+    SpriteBatch m_batch;
+
+public:
+    RenderingSystem(TextRenderingSystem &texts) : m_texts(texts) {}
+
+    // Render all sprites and texts of the snapshot in draw key order
+    void Render(SDL_Renderer *renderer, const RenderSnapshot &snapshot, float alpha)
+    {
+        PROFILE_ZONE("RenderingSystem::Render");
+        m_queue.Build(snapshot);
+        for (auto &item : m_queue.Items())
+        {
+            if (item.text)
+            {
+                m_texts.Draw(renderer, m_batch, snapshot.texts[item.index], alpha);
+                continue;
+            }
+            auto &sprite = snapshot.sprites[item.index];
+            float x = sprite.prevX + (sprite.x - sprite.prevX) * alpha;
+            float y = sprite.prevY + (sprite.y - sprite.prevY) * alpha;
+            SDL_Rect dstRect{static_cast<int>(x), static_cast<int>(y), sprite.w, sprite.h};
+            m_batch.Draw(renderer, sprite.texture, sprite.source.w > 0 ? &sprite.source : NULL, dstRect);
+        }
+        m_batch.Flush(renderer);
+    }
+};
+
+class ProjectileSystem
+{
+    AtlasRegion projectileSprite;
+    const PixelMask *projectileMask;
+    JobSystem &m_jobs;
+
+public:
+    ProjectileSystem(const GameTextures &textures, JobSystem &jobs) : m_jobs(jobs)
+    {
+        projectileSprite = textures.projectile;
+        projectileMask = textures.projectileMask;
+    }
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Write<InputComponent>().Write<PositionComponent>().Read<VelocityComponent>().Read<ProjectileComponent>().Write<PlayerComponent>().Write<TimerWheel>();
+    }
+    void Update(float deltaTime, EntityID player_id, ECS &ecs)
+    {
+        PROFILE_ZONE("ProjectileSystem::Update");
+        // Check if the space bar is pressed, shots are dropped while the weapon reloads
+        TimerWheel &timers = ecs.GetTimers();
+        for (auto [entity_id, input] : ecs.View<InputComponent>())
+        {
+            if (input->shoot)
+            {
+                PlayerComponent *player = ecs.GetComponent<PlayerComponent>(entity_id);
+                if (player && !timers.IsPending(player->weaponCooldown))
+                {
+                    FireProjectile(entity_id, ecs);
+                    player->weaponCooldown = timers.ScheduleSeconds(WEAPON_COOLDOWN_SECONDS, [] {});
+                }
+                input->shoot = false;
+            }
+        }
+
+        // hits are found by the CollisionSystem
+        auto projectiles = ecs.View<PositionComponent, VelocityComponent, ProjectileComponent>();
+        m_jobs.ParallelForEach(projectiles, [deltaTime](auto &entry)
+                               {
+            auto [entity_id, position, velocity, projectile] = entry;
+            position->x += velocity->x * deltaTime;
+            position->y += velocity->y * deltaTime; });
+
+        // projectiles leaving the screen are removed at the next ECS::Flush, on this thread as the timer wheel is not shared
+        for (auto &[entity_id, position, velocity, projectile] : projectiles)
+        {
+            if (position->y < 0)
+            {
+                EventLog() << "projectile missed: " << entity_id << std::endl;
+                DestroyProjectile(ecs, entity_id, *projectile);
+            }
+        }
+    }
+
+    // Remove a projectile at the next ECS::Flush together with its lifetime timer
+    static void DestroyProjectile(ECS &ecs, EntityID projectile_id, const ProjectileComponent &projectile)
+    {
+        ecs.GetTimers().Cancel(projectile.lifetime);
+        ECS::CommandBuffer &commands = ecs.GetCommandBuffer();
+        commands.SetSortKey(projectile_id);
+        commands.DestroyEntity(projectile_id);
+    }
+    void FireProjectile(EntityID player_id, ECS &ecs)
+    {
+        PlayerComponent *player = ecs.GetComponent<PlayerComponent>(player_id);
+        PositionComponent *position = ecs.GetComponent<PositionComponent>(player_id);
+        if (player != nullptr)
+        {
+            // spawn through the command buffer, the projectile appears at the next ECS::Flush
+            ECS::CommandBuffer &commands = ecs.GetCommandBuffer();
+            commands.SetSortKey(player_id);
+            auto projectile_id = commands.CreateEntity();
+            EventLog() << "Fire projectile id:" << projectile_id << std::endl;
+            commands.AddComponent<PositionComponent>(projectile_id, PositionComponent{position->x + 32, position->y - 30});
+            commands.AddComponent<VelocityComponent>(projectile_id, VelocityComponent{0, -100});
+            // removed after a while even if it never leaves the screen, through the command buffer like any other destruction
+            TimerHandle lifetime = ecs.GetTimers().ScheduleSeconds(PROJECTILE_LIFETIME_SECONDS, [&ecs, projectile_id]
+                                                                   {
+                ECS::CommandBuffer &commands = ecs.GetCommandBuffer();
+                commands.SetSortKey(projectile_id);
+                commands.DestroyEntity(projectile_id); });
+            commands.AddComponent<ProjectileComponent>(projectile_id, ProjectileComponent{.damage = 1, .lifetime = lifetime});
+            commands.AddComponent<SpriteComponent>(projectile_id, SpriteComponent{"", projectileSprite.texture, 3, 10, projectileSprite.rect});
+            commands.AddComponent<ColliderComponent>(projectile_id, ColliderComponent{3, 10, 0, 0, COLLISION_LAYER_PROJECTILE, ~0u, projectileMask});
+        }
+    }
+};
+
+// Two colliders touching during this tick, a is the lower ID.
+// time is the fraction of the tick at which they first touched, 0 for boxes that already overlapped.
+struct Contact
+{
+    EntityID a, b;
+    CollisionLayer layerA, layerB;
+    float time;
+};
+
+// Broadphase the collision stage pairs colliders with
+enum Broadphase
+{
+    // one uniform grid per layer rebuilt every tick, queried in parallel
+    BROADPHASE_GRID,
+    // sweep and prune over all colliders, sorted incrementally across ticks
+    BROADPHASE_SWEEP_AND_PRUNE,
+    // one dynamic AABB tree per layer moved incrementally across ticks, queried in parallel batches of projectiles
+    BROADPHASE_AABB_TREE,
+};
+
+// The single collision stage of a tick: finds every touching pair once and publishes them as a sorted contact list.
+// It only detects, the damage, score and destruction systems below respond to the contacts.
+class CollisionSystem
+{
+    JobSystem &m_jobs;
+    Broadphase m_broadphase = BROADPHASE_GRID;
+    // Colliders binned by position, one grid per layer, rebuilt every tick
+    std::vector<SpatialHash> m_grids = std::vector<SpatialHash>(COLLISION_LAYER_COUNT, SpatialHash(64));
+    // All colliders, projectiles with the box around their path of the tick
+    SweepAndPrune m_sweepAndPrune;
+    // Colliders binned by position, one tree per layer, kept across ticks
+    std::vector<DynamicAabbTree> m_trees = std::vector<DynamicAabbTree>(COLLISION_LAYER_COUNT);
+    // Leaf of every collider in the trees and the last tick it was seen
+    struct TreeProxy
+    {
+        CollisionLayer layer;
+        int proxy;
+        uint32_t tick;
+    };
+    std::unordered_map<EntityID, TreeProxy> m_treeProxies;
+    uint32_t m_treeTick = 0;
+    std::vector<Contact> m_contacts;
+    std::mutex m_contactsMutex;
+
+public:
+    CollisionSystem(JobSystem &jobs) : m_jobs(jobs) {}
+
+    void SetBroadphase(Broadphase broadphase) { m_broadphase = broadphase; }
+
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Read<PositionComponent>().Read<VelocityComponent>().Read<ColliderComponent>().Read<EnemyComponent>().Read<ProjectileComponent>().Read<PlayerComponent>().Write<Contact>();
+    }
+
+    // Contacts of the last update sorted by (a, b), no pair comes twice
+    const std::vector<Contact> &Contacts() const { return m_contacts; }
+
+    // Call fn(first_id, second_id, time) for every contact between the two layers, first_id on the first layer
+    template <typename F>
+    void ForEachContact(CollisionLayer first, CollisionLayer second, F fn) const
+    {
+        for (auto &contact : m_contacts)
+        {
+            if (contact.layerA == first && contact.layerB == second)
+            {
+                fn(contact.a, contact.b, contact.time);
+            }
+            else if (contact.layerA == second && contact.layerB == first)
+            {
+                fn(contact.b, contact.a, contact.time);
+            }
+        }
+    }
+
+    void Update(float deltaTime, ECS &ecs)
+    {
+        PROFILE_ZONE("CollisionSystem::Update");
+        m_contacts.clear();
+        if (m_broadphase == BROADPHASE_SWEEP_AND_PRUNE)
+        {
+            FindContactsSweepAndPrune(deltaTime, ecs);
+        }
+        else
+        {
+            FindContactsByQuery(deltaTime, ecs);
+        }
+
+        // the order the contacts were found in does not matter, and a box spanning two cells is reported once
+        std::sort(m_contacts.begin(), m_contacts.end(), [](const Contact &l, const Contact &r)
+                  { return std::tie(l.a, l.b, l.time) < std::tie(r.a, r.b, r.time); });
+        m_contacts.erase(std::unique(m_contacts.begin(), m_contacts.end(), [](const Contact &l, const Contact &r)
+                                     { return l.a == r.a && l.b == r.b; }),
+                         m_contacts.end());
+    }
+
+private:
+    // Where a projectile's collider starts the tick, how far it moves and the box around its whole path.
+    // The whole path is tested, so a fast projectile or a long step cannot jump over an enemy.
+    // Enemies are taken where they ended the tick, they move little compared to a projectile.
+    struct ColliderSweep
+    {
+        Aabb start;
+        float dx, dy;
+        Aabb path;
+    };
+
+    static ColliderSweep Sweep(const PositionComponent &position, const VelocityComponent &velocity, const ColliderComponent &collider, float deltaTime)
+    {
+        float dx = velocity.x * deltaTime;
+        float dy = velocity.y * deltaTime;
+        Aabb end = ColliderBox(position, collider);
+        Aabb start{end.minX - dx, end.minY - dy, end.maxX - dx, end.maxY - dy};
+        Aabb path{std::min(start.minX, end.minX), std::min(start.minY, end.minY), std::max(start.maxX, end.maxX), std::max(start.maxY, end.maxY)};
+        return ColliderSweep{start, dx, dy, path};
+    }
+
+    // Refine a contact the boxes found with the pixel masks of both colliders: the first time from time on at which
+    // a solid pixel of the first one, starting at start and moving by (dx, dy), covers one of the other.
+    // The path is walked in steps of at most a pixel. Colliders without a mask count as solid boxes.
+    static std::optional<float> PixelContact(ECS &ecs, EntityID id, const Aabb &start, float dx, float dy, float time, EntityID other_id, const Aabb &otherBox)
+    {
+        ColliderComponent *collider = ecs.GetComponent<ColliderComponent>(id);
+        ColliderComponent *other = ecs.GetComponent<ColliderComponent>(other_id);
+        if (collider == nullptr || other == nullptr || collider->shape == nullptr || other->shape == nullptr)
+        {
+            return time;
+        }
+        int otherX = static_cast<int>(std::floor(otherBox.minX));
+        int otherY = static_cast<int>(std::floor(otherBox.minY));
+        int steps = static_cast<int>(std::ceil(std::max(std::abs(dx), std::abs(dy)) * (1 - time)));
+        for (int step = 0; step <= steps; step++)
+        {
+            float t = steps == 0 ? time : time + (1 - time) * step / steps;
+            int x = static_cast<int>(std::floor(start.minX + dx * t));
+            int y = static_cast<int>(std::floor(start.minY + dy * t));
+            if (PixelMask::Overlap(*collider->shape, x, y, *other->shape, otherX, otherY))
+            {
+                return t;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Sweep of the entity if it is a projectile
+    static std::optional<ColliderSweep> ProjectileSweep(ECS &ecs, EntityID id, float deltaTime)
+    {
+        PositionComponent *position = ecs.GetComponent<PositionComponent>(id);
+        VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(id);
+        ColliderComponent *collider = ecs.GetComponent<ColliderComponent>(id);
+        if (ecs.GetComponent<ProjectileComponent>(id) == nullptr || position == nullptr || velocity == nullptr || collider == nullptr)
+        {
+            return std::nullopt;
+        }
+        return Sweep(*position, *velocity, *collider, deltaTime);
+    }
+
+    // Whether the table and the collider's mask let it touch colliders of the layer
+    static bool MayTouchLayer(const ColliderComponent &collider, int layer)
+    {
+        return (COLLISION_TABLE[collider.layer] & collider.mask & LayerBit(layer)) && (COLLISION_TABLE[layer] & LayerBit(collider.layer));
+    }
+
+    // Call fn(other_id, otherLayer, otherBox) for the colliders overlapping box that the given collider may touch.
+    // Grids or trees of layers the table or the collider's mask rule out are never looked at, the others' masks are matched in the query.
+    template <typename F>
+    void QueryLayers(EntityID id, const ColliderComponent &collider, const Aabb &box, F fn) const
+    {
+        for (int layer = 0; layer < COLLISION_LAYER_COUNT; layer++)
+        {
+            if (!MayTouchLayer(collider, layer))
+            {
+                continue;
+            }
+            auto report = [&](EntityID other_id, const Aabb &otherBox)
+            {
+                if (other_id != id)
+                {
+                    fn(other_id, static_cast<CollisionLayer>(layer), otherBox);
+                }
+            };
+            if (m_broadphase == BROADPHASE_AABB_TREE)
+            {
+                m_trees[layer].ForEachOverlap(box, report, LayerBit(collider.layer));
+            }
+            else
+            {
+                m_grids[layer].ForEachOverlap(box, report, LayerBit(collider.layer));
+            }
+        }
+    }
+
+    // Rebuild the grids from scratch with the colliders of the queried layers
+    void BuildGrids(ECS &ecs, uint32_t queried)
+    {
+        for (auto &grid : m_grids)
+        {
+            grid.Clear();
+        }
+        for (auto [entity_id, position, collider] : ecs.View<PositionComponent, ColliderComponent>())
+        {
+            if (queried & LayerBit(collider->layer))
+            {
+                m_grids[collider->layer].Insert(entity_id, ColliderBox(*position, *collider), collider->mask);
+            }
+        }
+    }
+
+    // Move the colliders of the queried layers in their trees, adding the new ones and removing those that are gone.
+    // Most colliders stay inside their fat box and cost a containment test.
+    void UpdateTrees(float deltaTime, ECS &ecs, uint32_t queried)
+    {
+        m_treeTick++;
+        for (auto [entity_id, position, collider] : ecs.View<PositionComponent, ColliderComponent>())
+        {
+            if (!(queried & LayerBit(collider->layer)))
+            {
+                continue;
+            }
+            Aabb box = ColliderBox(*position, *collider);
+            auto [it, inserted] = m_treeProxies.try_emplace(entity_id);
+            TreeProxy &proxy = it->second;
+            if (!inserted && proxy.layer != collider->layer)
+            {
+                m_trees[proxy.layer].Remove(proxy.proxy);
+                inserted = true;
+            }
+            if (inserted)
+            {
+                proxy = TreeProxy{collider->layer, m_trees[collider->layer].Insert(entity_id, box, collider->mask), m_treeTick};
+                continue;
+            }
+            VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(entity_id);
+            float dx = velocity ? velocity->x * deltaTime : 0;
+            float dy = velocity ? velocity->y * deltaTime : 0;
+            m_trees[proxy.layer].Move(proxy.proxy, box, dx, dy, collider->mask);
+            proxy.tick = m_treeTick;
+        }
+        for (auto it = m_treeProxies.begin(); it != m_treeProxies.end();)
+        {
+            if (it->second.tick != m_treeTick)
+            {
+                m_trees[it->second.layer].Remove(it->second.proxy);
+                it = m_treeProxies.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // Colliders go into the grid or tree of their layer, projectiles and players then query the ones of the layers they touch
+    void FindContactsByQuery(float deltaTime, ECS &ecs)
+    {
+        auto projectiles = ecs.View<ProjectileComponent, PositionComponent, VelocityComponent, ColliderComponent>();
+        auto players = ecs.View<PlayerComponent, PositionComponent, ColliderComponent>();
+
+        // grids or trees of layers no projectile or player may touch would never be queried, so they are not built
+        uint32_t queried = 0;
+        for (auto &[entity_id, projectile, position, velocity, collider] : projectiles)
+        {
+            queried |= COLLISION_TABLE[collider->layer] & collider->mask;
+        }
+        for (auto &[entity_id, player, position, collider] : players)
+        {
+            queried |= COLLISION_TABLE[collider->layer] & collider->mask;
+        }
+        if (m_broadphase == BROADPHASE_AABB_TREE)
+        {
+            UpdateTrees(deltaTime, ecs, queried);
+            FindProjectileContactsInBatches(deltaTime, ecs, projectiles);
+        }
+        else
+        {
+            BuildGrids(ecs, queried);
+            FindProjectileContacts(deltaTime, ecs, projectiles);
+        }
+
+        for (auto [player_id, player, position, collider] : players)
+        {
+            Aabb box = ColliderBox(*position, *collider);
+            QueryLayers(player_id, *collider, box, [&](EntityID other_id, CollisionLayer otherLayer, const Aabb &otherBox)
+                        {
+                if (PixelContact(ecs, player_id, box, 0, 0, 0, other_id, otherBox))
+                {
+                    m_contacts.push_back(MakeContact(player_id, collider->layer, other_id, otherLayer, 0));
+                } });
+        }
+    }
+
+    // Every projectile queries on its own, in parallel
+    template <typename View>
+    void FindProjectileContacts(float deltaTime, ECS &ecs, View &projectiles)
+    {
+        m_jobs.ParallelForEach(projectiles, [this, &ecs, deltaTime](auto &entry)
+                               {
+            auto [entity_id, projectile, position, velocity, collider] = entry;
+            ColliderSweep sweep = Sweep(*position, *velocity, *collider, deltaTime);
+            std::vector<Contact> found;
+            QueryLayers(entity_id, *collider, sweep.path, [&](EntityID other_id, CollisionLayer otherLayer, const Aabb &otherBox)
+                        {
+                auto time = SweepAabb(sweep.start, sweep.dx, sweep.dy, otherBox);
+                if (time)
+                {
+                    time = PixelContact(ecs, entity_id, sweep.start, sweep.dx, sweep.dy, *time, other_id, otherBox);
+                }
+                if (time)
+                {
+                    found.push_back(MakeContact(entity_id, collider->layer, other_id, otherLayer, *time));
+                } });
+            if (!found.empty())
+            {
+                std::lock_guard<std::mutex> lock(m_contactsMutex);
+                m_contacts.insert(m_contacts.end(), found.begin(), found.end());
+            } });
+    }
+
+    // The projectiles go into one batch per pair of their layer and a tree layer they may touch.
+    // Each batch queries its tree in one go, sharing the traversal stack, and the batches run in parallel.
+    template <typename View>
+    void FindProjectileContactsInBatches(float deltaTime, ECS &ecs, View &projectiles)
+    {
+        struct QueryBatch
+        {
+            std::vector<EntityID> ids;
+            std::vector<ColliderSweep> sweeps;
+            std::vector<Aabb> paths;
+        };
+        std::vector<QueryBatch> batches(COLLISION_LAYER_COUNT * COLLISION_LAYER_COUNT);
+        for (auto &[entity_id, projectile, position, velocity, collider] : projectiles)
+        {
+            ColliderSweep sweep = Sweep(*position, *velocity, *collider, deltaTime);
+            for (int layer = 0; layer < COLLISION_LAYER_COUNT; layer++)
+            {
+                if (MayTouchLayer(*collider, layer))
+                {
+                    QueryBatch &batch = batches[collider->layer * COLLISION_LAYER_COUNT + layer];
+                    batch.ids.push_back(entity_id);
+                    batch.sweeps.push_back(sweep);
+                    batch.paths.push_back(sweep.path);
+                }
+            }
+        }
+
+        TaskGroup group;
+        for (size_t index = 0; index < batches.size(); index++)
+        {
+            if (batches[index].ids.empty())
+            {
+                continue;
+            }
+            m_jobs.Run(group, [this, &ecs, &batches, index]
+                       {
+                PROFILE_ZONE("Projectile batch query");
+                const QueryBatch &batch = batches[index];
+                CollisionLayer layer = static_cast<CollisionLayer>(index / COLLISION_LAYER_COUNT);
+                CollisionLayer treeLayer = static_cast<CollisionLayer>(index % COLLISION_LAYER_COUNT);
+                std::vector<Contact> found;
+                m_trees[treeLayer].ForEachOverlap(batch.paths, [&](size_t i, EntityID other_id, const Aabb &otherBox)
+                                                  {
+                    if (other_id == batch.ids[i])
+                    {
+                        return;
+                    }
+                    const ColliderSweep &sweep = batch.sweeps[i];
+                    auto time = SweepAabb(sweep.start, sweep.dx, sweep.dy, otherBox);
+                    if (time)
+                    {
+                        time = PixelContact(ecs, batch.ids[i], sweep.start, sweep.dx, sweep.dy, *time, other_id, otherBox);
+                    }
+                    if (time)
+                    {
+                        found.push_back(MakeContact(batch.ids[i], layer, other_id, treeLayer, *time));
+                    } }, LayerBit(layer));
+                if (!found.empty())
+                {
+                    std::lock_guard<std::mutex> lock(m_contactsMutex);
+                    m_contacts.insert(m_contacts.end(), found.begin(), found.end());
+                } });
+        }
+        m_jobs.Wait(group);
+    }
+
+    void FindContactsSweepAndPrune(float deltaTime, ECS &ecs)
+    {
+        m_sweepAndPrune.Begin();
+        for (auto [entity_id, position, collider] : ecs.View<PositionComponent, ColliderComponent>())
+        {
+            auto sweep = ProjectileSweep(ecs, entity_id, deltaTime);
+            m_sweepAndPrune.Set(entity_id, sweep ? sweep->path : ColliderBox(*position, *collider), collider->layer, collider->mask);
+        }
+        m_sweepAndPrune.End();
+
+        // pairs the layer table and masks rule out are dropped before the y test.
+        // A projectile is swept against the other collider, its box in the sweep only bounds its path.
+        m_sweepAndPrune.ForEachPair(ShouldCollide, [&](EntityID firstId, const Aabb &firstBox, uint32_t firstLayer, EntityID secondId, const Aabb &secondBox, uint32_t secondLayer)
+                                    {
+            EntityID movingId = firstId, otherId = secondId;
+            const Aabb *otherBox = &secondBox;
+            auto sweep = ProjectileSweep(ecs, firstId, deltaTime);
+            if (!sweep)
+            {
+                sweep = ProjectileSweep(ecs, secondId, deltaTime);
+                std::swap(movingId, otherId);
+                otherBox = &firstBox;
+            }
+            std::optional<float> time;
+            if (sweep)
+            {
+                time = SweepAabb(sweep->start, sweep->dx, sweep->dy, *otherBox);
+                if (time)
+                {
+                    time = PixelContact(ecs, movingId, sweep->start, sweep->dx, sweep->dy, *time, otherId, *otherBox);
+                }
+            }
+            else
+            {
+                time = PixelContact(ecs, firstId, firstBox, 0, 0, 0, secondId, secondBox);
+            }
+            if (time)
+            {
+                m_contacts.push_back(MakeContact(firstId, static_cast<CollisionLayer>(firstLayer), secondId, static_cast<CollisionLayer>(secondLayer), *time));
+            } });
+    }
+
+    static Contact MakeContact(EntityID id, CollisionLayer layer, EntityID other, CollisionLayer otherLayer, float time)
+    {
+        return id < other ? Contact{id, other, layer, otherLayer, time} : Contact{other, id, otherLayer, layer, time};
+    }
+};
+
+// Applies the damage of this tick's contacts: a projectile hurts the first enemy on its path, and an enemy
+// ramming the player dies and costs the player one health, unless the player is still invulnerable.
+class DamageSystem
+{
+    CollisionSystem &m_collisions;
+
+public:
+    DamageSystem(CollisionSystem &collisions) : m_collisions(collisions) {}
+
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Read<Contact>().Write<EnemyComponent>().Write<ProjectileComponent>().Write<PlayerComponent>().Write<TimerWheel>();
+    }
+
+    void Update(ECS &ecs)
+    {
+        PROFILE_ZONE("DamageSystem::Update");
+        // first enemy on the path of every projectile, the lowest ID on a tie
+        std::map<EntityID, std::pair<float, EntityID>> projectileHits;
+        m_collisions.ForEachContact(COLLISION_LAYER_PROJECTILE, COLLISION_LAYER_ENEMY, [&projectileHits](EntityID projectile_id, EntityID enemy_id, float time)
+                                    {
+            auto [it, inserted] = projectileHits.try_emplace(projectile_id, time, enemy_id);
+            if (!inserted)
+            {
+                it->second = std::min(it->second, std::make_pair(time, enemy_id));
+            } });
+        for (auto &[projectile_id, hit] : projectileHits)
+        {
+            ProjectileComponent *projectile = ecs.GetComponent<ProjectileComponent>(projectile_id);
+            EnemyComponent *enemy = ecs.GetComponent<EnemyComponent>(hit.second);
+            if (projectile && enemy && !projectile->spent)
+            {
+                EventLog() << "Hit by:" << projectile_id << " at :" << hit.second << std::endl;
+                enemy->health -= projectile->damage;
+                projectile->spent = true;
+            }
+        }
+
+        // a player takes at most one hit per tick, from the colliding enemy with the lowest ID
+        std::map<EntityID, EntityID> playerHits;
+        m_collisions.ForEachContact(COLLISION_LAYER_PLAYER, COLLISION_LAYER_ENEMY, [&playerHits](EntityID player_id, EntityID enemy_id, float)
+                                    {
+            auto [it, inserted] = playerHits.try_emplace(player_id, enemy_id);
+            it->second = std::min(it->second, enemy_id); });
+        TimerWheel &timers = ecs.GetTimers();
+        for (auto &[player_id, enemy_id] : playerHits)
+        {
+            PlayerComponent *player = ecs.GetComponent<PlayerComponent>(player_id);
+            EnemyComponent *enemy = ecs.GetComponent<EnemyComponent>(enemy_id);
+            if (player && enemy && !timers.IsPending(player->invulnerable))
+            {
+                EventLog() << "Player catched by:" << enemy_id << " cached player" << std::endl;
+                enemy->health = 0;
+                player->health--;
+                if (player->health > 0)
+                {
+                    player->invulnerable = timers.ScheduleSeconds(INVULNERABLE_SECONDS, [] {});
+                }
+            }
+        }
+    }
+};
+
+// Points for every enemy shot down
+const int SCORE_PER_ENEMY = 10;
+
+// Scores the enemies the projectiles of this tick finished off
+class ScoreSystem
+{
+    CollisionSystem &m_collisions;
+    GameState &m_state;
+
+public:
+    ScoreSystem(CollisionSystem &collisions, GameState &state) : m_collisions(collisions), m_state(state) {}
+
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Read<Contact>().Read<EnemyComponent>().Write<GameState>();
+    }
+
+    void Update(ECS &ecs)
+    {
+        PROFILE_ZONE("ScoreSystem::Update");
+        // an enemy hit by several projectiles at once scores once
+        std::set<EntityID> killed;
+        m_collisions.ForEachContact(COLLISION_LAYER_PROJECTILE, COLLISION_LAYER_ENEMY, [&ecs, &killed](EntityID, EntityID enemy_id, float)
+                                    {
+            EnemyComponent *enemy = ecs.GetComponent<EnemyComponent>(enemy_id);
+            if (enemy && enemy->health <= 0)
+            {
+                killed.insert(enemy_id);
+            } });
+        m_state.score += static_cast<int>(killed.size()) * SCORE_PER_ENEMY;
+    }
+};
+
+// Removes what the contacts of this tick used up: spent projectiles, and enemies and players without health left.
+// Destruction goes through the command buffer, so it happens at the next ECS::Flush.
+class DestructionSystem
+{
+    CollisionSystem &m_collisions;
+
+public:
+    DestructionSystem(CollisionSystem &collisions) : m_collisions(collisions) {}
+
+    SystemAccess GetAccess() const
+    {
+        return SystemAccess().Read<Contact>().Read<EnemyComponent>().Read<ProjectileComponent>().Read<PlayerComponent>().Write<TimerWheel>();
+    }
+
+    void Update(ECS &ecs)
+    {
+        PROFILE_ZONE("DestructionSystem::Update");
+        std::set<EntityID> doomed;
+        for (auto &contact : m_collisions.Contacts())
+        {
+            for (EntityID id : {contact.a, contact.b})
+            {
+                if (UsedUp(ecs, id))
+                {
+                    doomed.insert(id);
+                }
+            }
+        }
+        ECS::CommandBuffer &commands = ecs.GetCommandBuffer();
+        for (EntityID id : doomed)
+        {
+            if (ProjectileComponent *projectile = ecs.GetComponent<ProjectileComponent>(id))
+            {
+                ProjectileSystem::DestroyProjectile(ecs, id, *projectile);
+                continue;
+            }
+            commands.SetSortKey(id);
+            commands.DestroyEntity(id);
+        }
+    }
+
+private:
+    static bool UsedUp(ECS &ecs, EntityID id)
+    {
+        ProjectileComponent *projectile = ecs.GetComponent<ProjectileComponent>(id);
+        EnemyComponent *enemy = ecs.GetComponent<EnemyComponent>(id);
+        PlayerComponent *player = ecs.GetComponent<PlayerComponent>(id);
+        return (projectile && projectile->spent) || (enemy && enemy->health <= 0) || (player && player->health <= 0);
+    }
+};
+
+class HUDSystem
+{
+    TextRenderingSystem &m_texts;
+    SpriteBatch m_batch;
+
+public:
+    HUDSystem(TextRenderingSystem &texts) : m_texts(texts) {}
+
+    void Render(SDL_Renderer *renderer, const RenderSnapshot &snapshot)
+    {
+        PROFILE_ZONE("HUDSystem::Render");
+        GlyphAtlas *atlas = m_texts.Atlas(renderer, "resources/arial.ttf", 12);
+        if (atlas == nullptr)
+        {
+            return;
+        }
+
+        std::stringstream ss;
+        ss << "Enemy:";
+        ss << snapshot.enemies;
+        atlas->Draw(renderer, m_batch, ss.str(), 0, 0);
+
+        std::stringstream ss2;
+        ss2 << "Object:";
+        ss2 << snapshot.objects;
+        atlas->Draw(renderer, m_batch, ss2.str(), SCREEN_WIDTH - atlas->Measure(ss2.str()), 0);
+
+        m_batch.Flush(renderer);
+    }
+};
+
+// One independent game: its entities, the simulation systems and their schedule.
+// The window runs one world on the simulation thread, the headless batch one per game.
+class World
+{
+public:
+    World(JobSystem &jobs, const GameTextures &textures, int tickRate, unsigned seed)
+        : enemy_movement_system(ecs, jobs), projectile_system(textures, jobs), collision_system(jobs),
+          damage_system(collision_system), score_system(collision_system, state), destruction_system(collision_system), scheduler(jobs)
+    {
+        state.seed = seed;
+
+        // Create player entity
+        player_id = ecs.CreateEntity();
+        ecs.AddComponent(player_id, PositionComponent{320.0f, SCREEN_HEIGHT - 64});
+        ecs.AddComponent(player_id, PlayerComponent{.name = "Player 1", .health = 10});
+        ecs.AddComponent(player_id, SpriteComponent{"", textures.player.texture, 64, 64, textures.player.rect});
+        // the ship stays on top of the enemies diving at it
+        ecs.AddComponent(player_id, RenderLayerComponent{RenderSnapshot::LAYER_SPRITES, 1});
+        ecs.AddComponent(player_id, ColliderComponent{64, 64, 0, 0, COLLISION_LAYER_PLAYER, ~0u, textures.playerMask});
+        ecs.AddComponent(player_id, TextComponent{"Player", "resources/arial.ttf", 28});
+        ecs.AddComponent(player_id, InputComponent{false, false, false, false, false, false, false, false});
+
+        ecs.GetTimers().SetTickSeconds(1.0f / tickRate);
+        script_system.Start(WaveScript(ecs, script_system, enemy_movement_system, player_id, textures, state));
+
+        scheduler.AddSystem("scripts", script_system.GetAccess(), [this](float deltaTime)
+                            { script_system.Update(deltaTime); });
+        scheduler.AddSystem("timers", timer_system.GetAccess(), [this](float)
+                            { timer_system.Update(ecs); });
+        scheduler.AddSystem("movement", movement_system.GetAccess(), [this](float deltaTime)
+                            { movement_system.Update(deltaTime, player_id, ecs); });
+        scheduler.AddSystem("enemy_movement", enemy_movement_system.GetAccess(), [this](float deltaTime)
+                            { enemy_movement_system.Update(deltaTime, ecs); });
+        scheduler.AddSystem("projectile", projectile_system.GetAccess(), [this](float deltaTime)
+                            { projectile_system.Update(deltaTime, player_id, ecs); });
+        scheduler.AddSystem("collision", collision_system.GetAccess(), [this](float deltaTime)
+                            { collision_system.Update(deltaTime, ecs); });
+        scheduler.AddSystem("damage", damage_system.GetAccess(), [this](float)
+                            { damage_system.Update(ecs); });
+        scheduler.AddSystem("score", score_system.GetAccess(), [this](float)
+                            { score_system.Update(ecs); });
+        scheduler.AddSystem("destruction", destruction_system.GetAccess(), [this](float)
+                            { destruction_system.Update(ecs); });
+    }
+
+    World(const World &) = delete;
+    World &operator=(const World &) = delete;
+
+    // Simulate one fixed step
+    void Tick(float deltaTime)
+    {
+        PROFILE_ZONE("Tick");
+        interpolation_system.SavePrevious(ecs);
+        scheduler.Run(deltaTime);
+        ecs.Flush();
+    }
+
+    ECS ecs;
+    GameState state;
+    MovementSystem movement_system;
+    EnemyMovementSystem enemy_movement_system;
+    ProjectileSystem projectile_system;
+    CollisionSystem collision_system;
+    DamageSystem damage_system;
+    ScoreSystem score_system;
+    DestructionSystem destruction_system;
+    ScriptSystem script_system;
+    TimerSystem timer_system;
+    InterpolationSystem interpolation_system;
+    InputSystem input_system;
+    SystemScheduler scheduler;
+    EntityID player_id;
+};
+
+// Lock-free ring buffer between exactly one producer thread and one consumer thread
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    // Producer side, returns false if the queue is full
+    bool Push(const T &value)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == Capacity)
+        {
+            return false;
+        }
+        m_items[head & (Capacity - 1)] = value;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, oldest item or nullptr if the queue is empty
+    const T *Front() const
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        return &m_items[tail & (Capacity - 1)];
+    }
+
+    // Consumer side, drop the item returned by Front
+    void Pop()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    // producer and consumer indices on separate cache lines
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+    T m_items[Capacity];
+};
+
+// SDL event stamped with SDL_GetPerformanceCounter() when it was polled
+struct InputEvent
+{
+    SDL_Event event;
+    uint64_t time;
+};
+
+// Events handed from the main thread, which owns the window, to the simulation thread
+using InputEventQueue = SpscQueue<InputEvent, 1024>;
+
+// Game settings, overridable from the command line
+struct GameConfig
+{
+    // simulation ticks per second
+    int tickRate = 120;
+    // ticks simulated at most per frame, a longer stall drops time instead of catching up
+    int maxCatchUpSteps = 8;
+    // Chrome trace written at exit, empty for none
+    std::string tracePath;
+    // rendered frames per second, 0 renders as fast as possible
+    int targetFps = 60;
+    // let the display pace rendering instead of the frame pacer
+    bool vsync = false;
+    // games simulated without a window as fast as possible, 0 opens the window
+    int headlessGames = 0;
+    // a headless game is won once this many waves are cleared
+    int winWaves = 3;
+    // a headless game still running after this many ticks counts as lost
+    int maxTicks = 120 * 60 * 5;
+    // input of the headless player: "random" or "tracker"
+    std::string bot = "tracker";
+    // seed of the headless batch, every game derives its own from it and its number
+    unsigned seed = 1;
+    // collision broadphase: "grid", "sap" or "tree"
+    Broadphase broadphase = BROADPHASE_GRID;
+    // colliders of the broadphase benchmark, 0 runs the game
+    int benchColliders = 0;
+    // share of the benchmark's colliders that are boss or bunker sized, in percent
+    int benchLargePercent = 5;
+};
+
+GameConfig ParseConfig(int argc, char *argv[])
+{
+    GameConfig config;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc)
+        {
+            config.tickRate = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--max-catch-up") == 0 && i + 1 < argc)
+        {
+            config.maxCatchUpSteps = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+        {
+            config.targetFps = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            config.tracePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--vsync") == 0)
+        {
+            config.vsync = true;
+        }
+        else if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+        {
+            config.headlessGames = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--waves") == 0 && i + 1 < argc)
+        {
+            config.winWaves = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--max-ticks") == 0 && i + 1 < argc)
+        {
+            config.maxTicks = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--bot") == 0 && i + 1 < argc)
+        {
+            config.bot = argv[++i];
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            config.seed = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        }
+        else if (strcmp(argv[i], "--bench-broadphase") == 0 && i + 1 < argc)
+        {
+            config.benchColliders = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--bench-large") == 0 && i + 1 < argc)
+        {
+            config.benchLargePercent = std::clamp(atoi(argv[++i]), 0, 100);
+        }
+        else if (strcmp(argv[i], "--broadphase") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            config.broadphase = strcmp(name, "sap") == 0 ? BROADPHASE_SWEEP_AND_PRUNE : strcmp(name, "tree") == 0 ? BROADPHASE_AABB_TREE : BROADPHASE_GRID;
+        }
+        else
+        {
+            std::cout << "Unknown argument: " << argv[i] << std::endl;
+        }
     }
-};
+    return config;
+}
 
-class EnemyMovementSystem
+// Turns variable frame times into a whole number of fixed simulation steps
+class FixedTimestep
 {
-    const float speed = 5.0f;
-
 public:
-    // Update entity with given ID
-    void Update(float deltaTime, EntityID player_id, ECS &ecs)
+    FixedTimestep(int tickRate, int maxSteps) : m_step(1.0 / tickRate), m_maxSteps(maxSteps) {}
+
+    // Add the real time elapsed since the last frame, returns how many ticks to simulate now
+    int Advance(double frameSeconds)
     {
-        PositionComponent *playerPosition = ecs.GetComponent<PositionComponent>(player_id);
-        for (auto entity_id : ecs.GetEntities())
+        m_accumulator += frameSeconds;
+        int steps = static_cast<int>(m_accumulator / m_step);
+        if (steps > m_maxSteps)
         {
-            EnemyComponent *enemy = ecs.GetComponent<EnemyComponent>(entity_id);
-            PositionComponent *position = ecs.GetComponent<PositionComponent>(entity_id);
-            VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(entity_id);
-
-            if (enemy && position && velocity)
-            {
-                position->x += velocity->x * deltaTime;
-
-                if (position->x < 10 || position->x > SCREEN_WIDTH - 64)
-                {
-                    // all enemy one line down and reverse direction
-                    for (auto enemy_id : ecs.GetEntities())
-                    {
-                        EnemyComponent *enemy = ecs.GetComponent<EnemyComponent>(enemy_id);
-                        PositionComponent *position = ecs.GetComponent<PositionComponent>(enemy_id);
-                        VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(enemy_id);
-                        if (enemy && position && velocity)
-                        {
-                            position->y += 64;
-                            velocity->x = velocity->x * -1;
-                        }
-                    }
-                }
-
-                if (position->y > SCREEN_HEIGHT)
-                {
-                    std::cout << "Enemy out of screen:" << entity_id << std::endl;
-                    ecs.DestroyEntity(entity_id);
-                }
-
-                if (playerPosition)
-                {
-                    SDL_Rect enemyLoc{static_cast<int>(position->x), static_cast<int>(position->y), 64, 64};
-                    SDL_Rect playerLoc{static_cast<int>(playerPosition->x), static_cast<int>(playerPosition->y), 64, 64};
-                    if (SDL_HasIntersection(&playerLoc, &enemyLoc))
-                    {
-                        std::cout << "Player catched by:" << entity_id << " cached player" << std::endl;
-                        ecs.DestroyEntity(entity_id);
-                        ecs.DestroyEntity(player_id);
-                        playerPosition = nullptr;
-                    }
-                }
-                else
-                {
-                    std::cout << "no player" << std::endl;
-                }
-            }
+            // too far behind, drop the time we cannot catch up with
+            steps = m_maxSteps;
+            m_accumulator = steps * m_step;
         }
+        m_accumulator -= steps * m_step;
+        return steps;
     }
+
+    float StepSeconds() const { return static_cast<float>(m_step); }
+
+private:
+    double m_step;
+    int m_maxSteps;
+    double m_accumulator = 0;
 };
 
-// Define systems
-class MovementSystem
+// Paces a loop to a target rate using the high resolution performance counter and measures the frame jitter.
+// Waiting sleeps for most of the remaining time and spins only for the last SPIN_SECONDS, as SDL_Delay can oversleep.
+class FramePacer
 {
-    const float speed = 5.0f;
-
 public:
-    // Update entity with given ID
-    void Update(float deltaTime, EntityID player_id, ECS &ecs)
+    // targetHz of 0 does not wait, it only measures
+    FramePacer(double targetHz)
+        : m_frequency(SDL_GetPerformanceFrequency()),
+          m_period(targetHz > 0 ? static_cast<uint64_t>(m_frequency / targetHz) : 0),
+          m_last(SDL_GetPerformanceCounter()),
+          m_next(m_last + m_period)
     {
-        InputComponent *input = ecs.GetComponent<InputComponent>(player_id);
-        PositionComponent *position = ecs.GetComponent<PositionComponent>(player_id);
-        VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(player_id);
-        auto text = ecs.GetComponent<TextComponent>(player_id);
+    }
 
-        if (input && position)
+    // Block until the next frame is due, returns the seconds since the previous call returned.
+    // With an idle callback the sleep is cut into 1 ms slices and the callback runs between them.
+    double Wait(const std::function<void()> &idle = nullptr)
+    {
+        if (m_period > 0)
         {
-            if (input->left)
+            uint64_t now = SDL_GetPerformanceCounter();
+            if (now < m_next)
             {
-                if (position->x > 0)
+                double remaining = static_cast<double>(m_next - now) / m_frequency;
+                if (idle)
                 {
-                    position->x -= speed;
+                    while (remaining > SPIN_SECONDS)
+                    {
+                        idle();
+                        SDL_Delay(1);
+                        remaining = static_cast<double>(m_next - std::min(m_next, SDL_GetPerformanceCounter())) / m_frequency;
+                    }
                 }
-            }
-            else if (input->right)
-            {
-                if (position->x < SCREEN_WIDTH - 64)
+                else if (remaining > SPIN_SECONDS)
+                {
+                    SDL_Delay(static_cast<uint32_t>((remaining - SPIN_SECONDS) * 1000));
+                }
+                while (SDL_GetPerformanceCounter() < m_next)
                 {
-                    position->x += speed;
                 }
+                m_next += m_period;
+            }
+            else
+            {
+                // missed the slot, restart the schedule instead of rushing to catch up
+                m_next = now + m_period;
             }
         }
 
-        if (text)
-        {
-            std::stringstream ss;
-            ss << "x:";
-            ss << position->x;
+        uint64_t now = SDL_GetPerformanceCounter();
+        double frameSeconds = static_cast<double>(now - m_last) / m_frequency;
+        m_last = now;
+        Record(frameSeconds);
+        return frameSeconds;
+    }
 
-            text->text = ss.str();
+    // Frame time statistics since the pacer was created
+    void PrintStats(const std::string &name) const
+    {
+        if (m_frames < 2)
+        {
+            return;
         }
+        double stddev = std::sqrt(m_m2 / (m_frames - 1));
+        std::cout << name << " frames:" << m_frames
+                  << " mean:" << m_mean * 1000 << "ms"
+                  << " jitter:" << stddev * 1000 << "ms"
+                  << " worst:" << m_worst * 1000 << "ms" << std::endl;
     }
+
+private:
+    static constexpr double SPIN_SECONDS = 0.002;
+
+    // Welford's running mean and variance of the frame time
+    void Record(double frameSeconds)
+    {
+        m_frames++;
+        double delta = frameSeconds - m_mean;
+        m_mean += delta / m_frames;
+        m_m2 += delta * (frameSeconds - m_mean);
+        m_worst = std::max(m_worst, frameSeconds);
+    }
+
+    uint64_t m_frequency;
+    uint64_t m_period;
+    uint64_t m_last;
+    uint64_t m_next;
+
+    uint64_t m_frames = 0;
+    double m_mean = 0;
+    double m_m2 = 0;
+    double m_worst = 0;
 };
 
-class RenderingSystem
+// Plays a headless game in place of the keyboard
+class Bot
 {
 public:
-    // Render all entities with sprite and position components
-    void Render(SDL_Renderer *renderer, ECS &ecs)
+    Bot(const std::string &kind, unsigned seed) : m_tracker(kind != "random"), m_random(static_cast<uint32_t>(MixSeed(seed, BOT_STREAM))) {}
+
+    // Set the player's input for the next tick
+    void Act(World &world)
     {
-        for (auto entity_id : ecs.GetEntities())
+        InputComponent *input = world.ecs.GetComponent<InputComponent>(world.player_id);
+        PositionComponent *position = world.ecs.GetComponent<PositionComponent>(world.player_id);
+        if (input == nullptr || position == nullptr)
         {
-            auto position = ecs.GetComponent<PositionComponent>(entity_id);
-            auto sprite = ecs.GetComponent<SpriteComponent>(entity_id);
-            if (position && sprite)
+            return;
+        }
+        int direction = 0;
+        if (m_tracker)
+        {
+            // stand under the closest enemy and keep firing, the weapon cooldown limits the rate
+            float target = position->x;
+            float closest = std::numeric_limits<float>::max();
+            for (auto [enemy_id, enemy, enemyPosition] : world.ecs.View<EnemyComponent, PositionComponent>())
+            {
+                float distance = std::abs(enemyPosition->x - position->x);
+                if (distance < closest)
+                {
+                    closest = distance;
+                    target = enemyPosition->x;
+                }
+            }
+            direction = target > position->x + 5 ? 1 : (target < position->x - 5 ? -1 : 0);
+            input->shoot = true;
+        }
+        else
+        {
+            // hold a random direction for a random while and fire at random
+            if (m_hold-- <= 0)
             {
-                SDL_Rect dstRect{static_cast<int>(position->x), static_cast<int>(position->y), sprite->w, sprite->h};
-                SDL_RenderCopy(renderer, sprite->texture, NULL, &dstRect);
+                m_direction = std::uniform_int_distribution<int>(-1, 1)(m_random);
+                m_hold = std::uniform_int_distribution<int>(10, 60)(m_random);
             }
+            direction = m_direction;
+            input->shoot = std::uniform_int_distribution<int>(0, 9)(m_random) == 0;
         }
+        input->left = direction < 0;
+        input->right = direction > 0;
     }
+
+private:
+    // stream of the bot's choices, apart from the entity IDs that number the enemies' streams
+    static const uint64_t BOT_STREAM = ~0ull;
+
+    bool m_tracker;
+    std::mt19937 m_random;
+    int m_direction = 0;
+    int m_hold = 0;
 };
 
-class ProjectileSystem
+// How one headless game ended
+struct GameResult
 {
-    SDL_Texture *projectileTexture;
+    int ticks = 0;
+    bool won = false;
+    int score = 0;
+};
 
-public:
-    ProjectileSystem(SDL_Texture *projectile_texture)
+// Pixel mask of an image at w x h without creating a texture, for the headless games
+PixelMask LoadPixelMask(std::string path, int w, int h)
+{
+    SDL_Surface *surface = IMG_Load(path.c_str());
+    if (surface == nullptr)
     {
-        projectileTexture = projectile_texture;
+        std::cout << "IMG_Load Error: " << IMG_GetError() << std::endl;
+        return PixelMask();
     }
-    void Update(float deltaTime, EntityID player_id, ECS &ecs)
-    {
-        // Check if the space bar is pressed
-        for (auto entity_id : ecs.GetEntities())
-        {
-            InputComponent *input = ecs.GetComponent<InputComponent>(entity_id);
-            PositionComponent *position = ecs.GetComponent<PositionComponent>(entity_id);
-            VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(entity_id);
-            ProjectileComponent *projectile = ecs.GetComponent<ProjectileComponent>(entity_id);
-
-            // handle input
-            if (input)
-            {
-                if (input->shoot)
-                {
-                    FireProjectile(entity_id, ecs);
-                    input->shoot = false;
-                }
-            }
-
-            if (position && velocity && projectile)
-            {
-                position->x += velocity->x * deltaTime;
-                position->y += velocity->y * deltaTime;
+    PixelMask mask = PixelMask::FromSurface(surface, w, h);
+    SDL_FreeSurface(surface);
+    return mask;
+}
 
-                if (position->y < 0)
-                {
-                    std::cout << "projectile missed: " << entity_id << std::endl;
-                    // out of screen remove it
-                    ecs.DestroyEntity(entity_id);
-                }
+// The mask to give a collider, none when the image had no usable one
+const PixelMask *MaskOrNull(const PixelMask &mask)
+{
+    return mask.Empty() ? nullptr : &mask;
+}
 
-                for (auto enemy_id : ecs.GetEntities())
-                {
-                    auto enemy = ecs.GetComponent<EnemyComponent>(enemy_id);
-                    if (enemy)
-                    {
-                        PositionComponent *enemyPos = ecs.GetComponent<PositionComponent>(enemy_id);
+// Time the projectile queries of one tick against config.benchColliders colliders of mixed sizes, upkeep included:
+// the brute force loop every projectile against every collider that ProjectileSystem::Update used to run,
+// the grid rebuilt every tick, and the tree moved incrementally and queried in one batch. The hit counts must agree.
+int RunBroadphaseBenchmark(const GameConfig &config)
+{
+    const int ticks = 60;
+    const float area = 1600;
+    const float speed = 2;
+    std::mt19937 random(static_cast<uint32_t>(MixSeed(config.seed, 0)));
+    std::uniform_real_distribution<float> coordinate(0, area);
+    std::uniform_real_distribution<float> small(8, 64), large(200, 400);
 
-                        SDL_Rect projectileLoc{static_cast<int>(position->x), static_cast<int>(position->y), 3, 10};
-                        SDL_Rect enemyLoc{static_cast<int>(enemyPos->x), static_cast<int>(enemyPos->y), 64, 64};
-                        if (SDL_HasIntersection(&projectileLoc, &enemyLoc))
-                        {
-                            std::cout << "Hit by:" << entity_id << " at :" << enemy_id << std::endl;
-                            ecs.DestroyEntity(entity_id);
-                            ecs.DestroyEntity(enemy_id);
-                            break;
-                        }
-                    }
-                }
-            }
-        }
+    std::vector<Aabb> colliders;
+    for (int i = 0; i < config.benchColliders; i++)
+    {
+        bool isLarge = static_cast<int>(random() % 100) < config.benchLargePercent;
+        float x = coordinate(random), y = coordinate(random);
+        float w = isLarge ? large(random) : small(random), h = isLarge ? large(random) : small(random);
+        colliders.push_back(Aabb{x, y, x + w, y + h});
     }
-    void FireProjectile(EntityID player_id, ECS &ecs)
+    std::vector<Aabb> projectiles;
+    for (int i = 0; i < config.benchColliders / 5 + 50; i++)
     {
-        PlayerComponent *player = ecs.GetComponent<PlayerComponent>(player_id);
-        PositionComponent *position = ecs.GetComponent<PositionComponent>(player_id);
-        VelocityComponent *velocity = ecs.GetComponent<VelocityComponent>(player_id);
-        if (player != nullptr)
+        float x = coordinate(random), y = coordinate(random);
+        projectiles.push_back(Aabb{x, y, x + 3, y + 30});
+    }
+    // the colliders drift sideways a little every tick, like the formation
+    auto step = [&](int tick)
+    {
+        float dx = tick % 2 == 0 ? speed : -speed;
+        for (auto &box : colliders)
         {
-            auto projectile_id = ecs.CreateEntity();
-            std::cout << "Fire projectile id:" << projectile_id << std::endl;
-            ecs.AddComponent<PositionComponent>(projectile_id, PositionComponent{position->x + 32, position->y - 30});
-            ecs.AddComponent<VelocityComponent>(projectile_id, VelocityComponent{0, -100});
-            ecs.AddComponent<ProjectileComponent>(projectile_id, ProjectileComponent{1});
-            ecs.AddComponent<SpriteComponent>(projectile_id, SpriteComponent{"", projectileTexture, 3, 10});
+            box.minX += dx;
+            box.maxX += dx;
         }
-    }
-};
+        return dx;
+    };
+    auto overlap = [](const Aabb &a, const Aabb &b)
+    {
+        return a.minX < b.maxX && b.minX < a.maxX && a.minY < b.maxY && b.minY < a.maxY;
+    };
 
-class TextRenderingSystem
-{
-public:
-    // Render all entities with text and position components
-    void Render(SDL_Renderer *renderer, ECS &ecs)
+    uint64_t bruteHits = 0;
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int tick = 0; tick < ticks; tick++)
     {
-        for (auto entity_id : ecs.GetEntities())
+        step(tick);
+        for (auto &projectile : projectiles)
         {
-            auto position = ecs.GetComponent<PositionComponent>(entity_id);
-            auto text = ecs.GetComponent<TextComponent>(entity_id);
-            if (position && text)
+            for (auto &box : colliders)
             {
-                // Load font
-                TTF_Font *font = TTF_OpenFont(text->font.c_str(), text->size);
-                if (font == nullptr)
-                {
-                    continue;
-                }
-                SDL_Surface *surfaceMessage = TTF_RenderText_Solid(font, text->text.c_str(), {255, 255, 255});
-                text->texture = SDL_CreateTextureFromSurface(renderer, surfaceMessage);
-                SDL_Rect dstRect{static_cast<int>(position->x), static_cast<int>(position->y - 5), surfaceMessage->w, surfaceMessage->h};
-                SDL_RenderCopy(renderer, text->texture, NULL, &dstRect);
-                SDL_FreeSurface(surfaceMessage);
-                TTF_CloseFont(font);
+                bruteHits += overlap(projectile, box) ? 1 : 0;
             }
         }
     }
-};
-
-class HUDSystem
-{
+    uint64_t bruteTime = SDL_GetPerformanceCounter() - start;
 
-public:
-    void Render(SDL_Renderer *renderer, ECS &ecs, EntityID player_id)
+    uint64_t gridHits = 0;
+    SpatialHash grid(64);
+    std::vector<EntityID> found;
+    start = SDL_GetPerformanceCounter();
+    for (int tick = 0; tick < ticks; tick++)
     {
-        TTF_Font *font = TTF_OpenFont("resources/arial.ttf", 12);
-        if (font == nullptr)
+        step(tick);
+        grid.Clear();
+        for (size_t i = 0; i < colliders.size(); i++)
         {
-            return;
+            grid.Insert(static_cast<EntityID>(i), colliders[i]);
         }
-        int numberOfEnemies = 0;
-        int numberOfObject = 0;
-        for (auto entity_id : ecs.GetEntities())
+        for (auto &projectile : projectiles)
         {
-            auto enemy = ecs.GetComponent<EnemyComponent>(entity_id);
-            if (enemy)
-            {
-                numberOfEnemies++;
-            }
-            numberOfObject++;
+            // a box spanning several cells comes once per cell
+            found.clear();
+            grid.ForEachOverlap(projectile, [&found](EntityID id, const Aabb &)
+                                { found.push_back(id); });
+            std::sort(found.begin(), found.end());
+            gridHits += std::unique(found.begin(), found.end()) - found.begin();
         }
+    }
+    uint64_t gridTime = SDL_GetPerformanceCounter() - start;
 
-        std::stringstream ss;
-        ss << "Enemy:";
-        ss << numberOfEnemies;
+    uint64_t treeHits = 0;
+    DynamicAabbTree tree;
+    std::vector<int> proxies;
+    for (size_t i = 0; i < colliders.size(); i++)
+    {
+        proxies.push_back(tree.Insert(static_cast<EntityID>(i), colliders[i]));
+    }
+    start = SDL_GetPerformanceCounter();
+    for (int tick = 0; tick < ticks; tick++)
+    {
+        float dx = step(tick);
+        for (size_t i = 0; i < colliders.size(); i++)
+        {
+            tree.Move(proxies[i], colliders[i], dx, 0);
+        }
+        tree.ForEachOverlap(projectiles, [&treeHits](size_t, EntityID, const Aabb &)
+                            { treeHits++; });
+    }
+    uint64_t treeTime = SDL_GetPerformanceCounter() - start;
 
-        SDL_Surface *surfaceMessage = TTF_RenderText_Solid(font, ss.str().c_str(), {255, 255, 255});
-        auto texture = SDL_CreateTextureFromSurface(renderer, surfaceMessage);
-        SDL_Rect dstRect{0, 0, surfaceMessage->w, surfaceMessage->h};
-        SDL_RenderCopy(renderer, texture, NULL, &dstRect);
-        SDL_FreeSurface(surfaceMessage);
+    double usPerTick = 1e6 / SDL_GetPerformanceFrequency() / ticks;
+    std::cout << "Broadphase colliders:" << colliders.size()
+              << " large %:" << config.benchLargePercent
+              << " projectiles:" << projectiles.size()
+              << " brute us/tick:" << bruteTime * usPerTick
+              << " grid us/tick:" << gridTime * usPerTick
+              << " tree us/tick:" << treeTime * usPerTick
+              << " tree height:" << tree.Height()
+              << " hits:" << bruteHits << "/" << gridHits << "/" << treeHits << std::endl;
+    return bruteHits == gridHits && gridHits == treeHits ? 0 : 1;
+}
 
-        std::stringstream ss2;
-        ss2 << "Object:";
-        ss2 << numberOfObject;
+// Play config.headlessGames games without a window, one per worker thread, and print the aggregate stats.
+// Every game runs the same World as the window, only the input comes from a bot.
+int RunHeadless(const GameConfig &config)
+{
+    g_eventLog = false;
+    std::vector<GameResult> results(config.headlessGames);
+    std::atomic<uint64_t> totalTicks{0};
+    float stepSeconds = 1.0f / config.tickRate;
+    // the masks are shared read only by every game, no textures are needed without a renderer
+    PixelMask player_mask = LoadPixelMask("resources/ship.png", 64, 64);
+    PixelMask enemy_mask = LoadPixelMask("resources/enemy.png", 64, 64);
+    PixelMask projectile_mask = LoadPixelMask("resources/projectile.png", 3, 10);
+    GameTextures textures{AtlasRegion(), AtlasRegion(), AtlasRegion(), MaskOrNull(player_mask), MaskOrNull(enemy_mask), MaskOrNull(projectile_mask)};
 
-        SDL_Surface *surfaceMessage2 = TTF_RenderText_Solid(font, ss2.str().c_str(), {255, 255, 255});
-        auto texture2 = SDL_CreateTextureFromSurface(renderer, surfaceMessage2);
-        SDL_Rect dstRect2{SCREEN_WIDTH - surfaceMessage2->w, 0, surfaceMessage2->w, surfaceMessage2->h};
-        SDL_RenderCopy(renderer, texture2, NULL, &dstRect2);
-        SDL_FreeSurface(surfaceMessage2);
+    uint64_t start = SDL_GetPerformanceCounter();
+    {
+        // whole games are the tasks, each one steps its world alone on the thread that took it
+        JobSystem games(std::max(1u, std::thread::hardware_concurrency()) - 1);
+        TaskGroup group;
+        for (int game = 0; game < config.headlessGames; game++)
+        {
+            games.Run(group, [&, game]
+                      {
+                PROFILE_ZONE("Headless game");
+                // mixed, so the games of a batch do not share streams with the ones of nearby seeds
+                unsigned seed = static_cast<unsigned>(MixSeed(config.seed, game));
+                JobSystem inline_jobs(0);
+                World world(inline_jobs, textures, config.tickRate, seed);
+                world.collision_system.SetBroadphase(config.broadphase);
+                Bot bot(config.bot, seed);
+                GameResult &result = results[game];
+                while (result.ticks < config.maxTicks && world.ecs.IsAlive(world.player_id))
+                {
+                    bot.Act(world);
+                    world.Tick(stepSeconds);
+                    result.ticks++;
+                    if (world.state.wavesCleared >= config.winWaves)
+                    {
+                        result.won = true;
+                        break;
+                    }
+                }
+                result.score = world.state.score;
+                totalTicks += result.ticks; });
+        }
+        games.Wait(group);
+    }
+    double seconds = static_cast<double>(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
 
-        TTF_CloseFont(font);
+    int wins = 0;
+    double survivalSeconds = 0;
+    double score = 0;
+    for (auto &result : results)
+    {
+        wins += result.won ? 1 : 0;
+        survivalSeconds += result.ticks * stepSeconds;
+        score += result.score;
     }
-};
+    std::cout << "Headless games:" << config.headlessGames
+              << " bot:" << config.bot
+              << " seconds:" << seconds
+              << " ticks/s:" << totalTicks / seconds
+              << " games/min:" << config.headlessGames * 60.0 / seconds
+              << " win rate:" << static_cast<double>(wins) / config.headlessGames
+              << " mean survival s:" << survivalSeconds / config.headlessGames
+              << " mean score:" << score / config.headlessGames << std::endl;
+    return 0;
+}
 
-SDL_Texture *LoadTexture(std::string path, SDL_Renderer *renderer)
+// Queue an image drawn at w x h in the atlas and build its pixel mask if mask is given.
+// Returns the index of its atlas region, -1 if it could not be loaded.
+int LoadSprite(std::string path, TextureAtlas &atlas, int w, int h, PixelMask *mask = nullptr)
 {
     SDL_Surface *surface = IMG_Load(path.c_str());
     if (surface == nullptr)
     {
         std::cout << "IMG_Load Error: " << IMG_GetError() << std::endl;
-        return nullptr;
+        return -1;
     }
-
-    SDL_Texture *sprite_texture = SDL_CreateTextureFromSurface(renderer, surface);
-    if (sprite_texture == nullptr)
+    if (mask)
     {
-        std::cout << "SDL_CreateTextureFromSurface Error: " << SDL_GetError() << std::endl;
-        SDL_FreeSurface(surface);
-        return nullptr;
+        *mask = PixelMask::FromSurface(surface, w, h);
     }
+    int sprite = atlas.Add(surface, w, h);
     SDL_FreeSurface(surface);
-    return sprite_texture;
+    return sprite;
 }
 
 // Main function
 int main(int argc, char *argv[])
 {
+    GameConfig config = ParseConfig(argc, argv);
+    if (config.benchColliders > 0)
+    {
+        return RunBroadphaseBenchmark(config);
+    }
+    if (config.headlessGames > 0)
+    {
+        return RunHeadless(config);
+    }
+
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) != 0)
     {
@@ -577,7 +4782,7 @@ int main(int argc, char *argv[])
     }
 
     // Create SDL renderer
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | (config.vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
     if (renderer == nullptr)
     {
         std::cout << "SDL_CreateRenderer Error: " << SDL_GetError() << std::endl;
@@ -586,10 +4791,12 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    // Load sprite
+    // Load sprites, they are packed into one atlas texture
+    TextureAtlas atlas;
     std::string playerTexturePath = "resources/ship.png";
-    SDL_Texture *player_texture = LoadTexture(playerTexturePath, renderer);
-    if (player_texture == nullptr)
+    PixelMask player_mask, enemy_mask, projectile_mask;
+    int player_sprite = LoadSprite(playerTexturePath, atlas, 64, 64, &player_mask);
+    if (player_sprite < 0)
     {
         std::cout << "Player Texture Load Error: " << playerTexturePath << std::endl;
         SDL_DestroyRenderer(renderer);
@@ -599,8 +4806,8 @@ int main(int argc, char *argv[])
     }
 
     std::string enemyTexturePath = "resources/enemy.png";
-    SDL_Texture *enemy_texture = LoadTexture(enemyTexturePath, renderer);
-    if (enemy_texture == nullptr)
+    int enemy_sprite = LoadSprite(enemyTexturePath, atlas, 64, 64, &enemy_mask);
+    if (enemy_sprite < 0)
     {
         std::cout << "Enemy Texture Load Error: " << enemyTexturePath << std::endl;
         SDL_DestroyRenderer(renderer);
@@ -610,8 +4817,8 @@ int main(int argc, char *argv[])
     }
 
     std::string projectileTexturePath = "resources/projectile.png";
-    SDL_Texture *projectile_texture = LoadTexture(projectileTexturePath, renderer);
-    if (projectile_texture == nullptr)
+    int projectile_sprite = LoadSprite(projectileTexturePath, atlas, 3, 10, &projectile_mask);
+    if (projectile_sprite < 0)
     {
         std::cout << "Enemy Texture Load Error: " << projectileTexturePath << std::endl;
         SDL_DestroyRenderer(renderer);
@@ -620,89 +4827,149 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    std::cout << "start create ECS" << std::endl;
-    // Create entity-component system
-    ECS ecs;
+    if (!atlas.Build(renderer))
+    {
+        std::cout << "Texture Atlas Build Error" << std::endl;
+        atlas.Destroy();
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
+    std::cout << "Texture atlas pages: " << atlas.Pages() << std::endl;
 
-    // Create player entity
-    InputComponent playerInputComponent = InputComponent{false, false, false, false, false, false, false, false};
+    std::cout << "start create ECS" << std::endl;
+    // Worker threads for the simulation, the main thread joins in while it waits
+    JobSystem job_system(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    // Create the game world with the player entity and its simulation systems
+    GameTextures textures{atlas.Region(player_sprite), atlas.Region(enemy_sprite), atlas.Region(projectile_sprite), MaskOrNull(player_mask), MaskOrNull(enemy_mask), MaskOrNull(projectile_mask)};
+    World world(job_system, textures, config.tickRate, config.seed);
+    world.collision_system.SetBroadphase(config.broadphase);
 
-    EntityID player_id = ecs.CreateEntity();
-    ecs.AddComponent(player_id, PositionComponent{320.0f, SCREEN_HEIGHT - 64});
-    ecs.AddComponent(player_id, PlayerComponent{"Player 1", 10});
-    ecs.AddComponent(player_id, SpriteComponent{"", player_texture, 64, 64});
-    ecs.AddComponent(player_id, TextComponent{"Player", "resources/arial.ttf", 28, nullptr});
-    ecs.AddComponent(player_id, playerInputComponent);
+    // Define systems
+    TextRenderingSystem text_rendering_system;
+    HUDSystem hud_system(text_rendering_system);
+    RenderingSystem rendering_system(text_rendering_system);
 
-    int textureSize = 64;
-    int enemyLines = 3;
-    for (size_t j = 0; j < enemyLines; j++)
-    {
-        for (size_t i = 10; i < SCREEN_WIDTH - textureSize; i += (textureSize * 2))
+    // The simulation runs on its own thread and publishes a render snapshot after every batch of ticks.
+    // This thread keeps the window, the SDL event loop and the renderer, as SDL requires.
+    SnapshotSystem snapshot_system;
+    TripleBuffer<RenderSnapshot> snapshots;
+    InputEventQueue input_events;
+    std::atomic<bool> running{true};
+    std::thread simulation_thread([&]
+                                  {
+        PROFILE_THREAD("Simulation");
+        FixedTimestep timestep(config.tickRate, config.maxCatchUpSteps);
+        FramePacer tick_pacer(config.tickRate);
+        uint64_t batchStart = SDL_GetPerformanceCounter();
+        while (running)
         {
-            EntityID enemy_id = ecs.CreateEntity();
-
-            std::stringstream ss;
-            ss << enemy_id;
-            ecs.AddComponent(enemy_id, PositionComponent{(float)i, (float)j * textureSize});
-            ecs.AddComponent(enemy_id, SpriteComponent{"", enemy_texture, 64, 64});
-            ecs.AddComponent(enemy_id, TextComponent{ss.str().c_str(), "resources/arial.ttf", 10, nullptr});
-            ecs.AddComponent(enemy_id, VelocityComponent{50, 0});
-            ecs.AddComponent(enemy_id, EnemyComponent{1});
+            int steps = timestep.Advance(tick_pacer.Wait());
+            if (steps == 0)
+            {
+                continue;
+            }
+            // Update game state in fixed steps, spread over the real time since the last batch.
+            // An event is applied before the first tick whose share of that time ends after the event was polled.
+            uint64_t batchEnd = SDL_GetPerformanceCounter();
+            for (int step = 0; step < steps; step++)
+            {
+                uint64_t boundary = batchStart + (batchEnd - batchStart) * (step + 1) / steps;
+                while (const InputEvent *input = input_events.Front())
+                {
+                    if (input->time > boundary)
+                    {
+                        break;
+                    }
+                    world.input_system.handleEvent(input->event, world.ecs);
+                    input_events.Pop();
+                }
+                world.Tick(timestep.StepSeconds());
+            }
+            batchStart = batchEnd;
+            RenderSnapshot &snapshot = snapshots.WriteBuffer();
+            snapshot_system.Capture(world.ecs, world.player_id, snapshot);
+            snapshot.tickSeconds = timestep.StepSeconds();
+            snapshot.publishTime = SDL_GetPerformanceCounter();
+            snapshots.Publish();
         }
-    }
-    // Define systems
-    MovementSystem movement_system;
-    EnemyMovementSystem enemy_movement_system;
-    HUDSystem hud_system;
-
-    RenderingSystem rendering_system;
-    TextRenderingSystem text_rendering_system;
-    ProjectileSystem projectile_system(projectile_texture);
-    InputSystem input_system;
+        tick_pacer.PrintStats("Simulation"); });
 
-    // Start game loop
-    uint32_t previousTime = SDL_GetTicks();
+    // Start game loop, with vsync the display paces the frames and the pacer only measures
+    FramePacer frame_pacer(config.vsync ? 0 : config.targetFps);
     bool quit = false;
-    SDL_Event event;
-    std::cout << "before loop" << std::endl;
-    while (!quit)
+    // polled at the start of every frame and while the pacer waits for the next one
+    auto pump_events = [&]
     {
-        // Process events
+        SDL_Event event;
         while (SDL_PollEvent(&event))
         {
-            if (event.type == SDL_QUIT || playerInputComponent.quit)
+            if (event.type == SDL_QUIT)
             {
-                std::cout << "exiting" << std::endl;
                 quit = true;
-                break;
             }
-            input_system.handleEvent(event, ecs);
+#ifndef SPACEINVADER_NO_PROFILE
+            else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F12 && !event.key.repeat)
+            {
+                // on demand trace of the last few seconds
+                Profiler::Get().ExportChromeTrace("trace.json");
+            }
+#endif
+            else if (!input_events.Push(InputEvent{event, SDL_GetPerformanceCounter()}))
+            {
+                std::cout << "Input queue full, event dropped" << std::endl;
+            }
+        }
+    };
+    PROFILE_THREAD("Main");
+    std::cout << "before loop" << std::endl;
+    while (!quit)
+    {
+        PROFILE_ZONE("Frame");
+        // Process events
+        pump_events();
+
+        snapshots.Fetch();
+        const RenderSnapshot &snapshot = snapshots.ReadBuffer();
+        if (snapshot.quit)
+        {
+            quit = true;
+        }
+        if (quit)
+        {
+            std::cout << "exiting" << std::endl;
+            break;
         }
-        // collected events
 
-        uint32_t currentTime = SDL_GetTicks();
-        float deltaTime = (currentTime - previousTime) / 1000.0f;
-        previousTime = currentTime;
-        // Update game state
-        movement_system.Update(deltaTime, player_id, ecs);
-        enemy_movement_system.Update(deltaTime, player_id, ecs);
-        projectile_system.Update(deltaTime, player_id, ecs);
         //  Render game state
+        float alpha = snapshot.Alpha(SDL_GetPerformanceCounter());
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
-        hud_system.Render(renderer, ecs, player_id);
-        rendering_system.Render(renderer, ecs);
-        text_rendering_system.Render(renderer, ecs);
+        rendering_system.Render(renderer, snapshot, alpha);
+        // the HUD layer is above everything of the snapshot
+        hud_system.Render(renderer, snapshot);
 
-        SDL_RenderPresent(renderer);
+        {
+            PROFILE_ZONE("SDL_RenderPresent");
+            SDL_RenderPresent(renderer);
+        }
+        frame_pacer.Wait(pump_events);
+    }
+    running = false;
+    simulation_thread.join();
+    frame_pacer.PrintStats("Render");
+#ifndef SPACEINVADER_NO_PROFILE
+    if (!config.tracePath.empty())
+    {
+        Profiler::Get().ExportChromeTrace(config.tracePath);
     }
+#endif
 
     // Clean up
 
-    SDL_DestroyTexture(player_texture);
-    SDL_DestroyTexture(enemy_texture);
-    SDL_DestroyTexture(projectile_texture);
+    atlas.Destroy();
+    text_rendering_system.Destroy();
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();